@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Replay recorded inputs headless on a software GL driver, timing each frame.
+#
+#   FLEXFOV_RECORD=inputs.txt ./run.sh                 (record a session first)
+#   ./bench.sh inputs.txt [frames] [fov] [pitch] [save file]
+#
+# Writes per-frame timings to bench.csv and a summary to bench.txt,
+# which can be diffed between builds.
+#
+# With a frame count, the last frame is also written to golden.* and checked
+# against the CPU mirror of the projection (flexfov_bench -g), failing if it differs.
+
+set -ex
+
+inputs=$(realpath "$1")
+frames=${2:-0}
+fov=${3:-240}
+pitch=${4:-0}
+save=${5:-}
+golden=""
+if [ "$frames" -gt 0 ]; then
+  golden=golden
+fi
+
+make all
+
+pushd sm64-port
+gmake
+
+# start from the same save file every time (the game writes to it as it plays)
+rm -f sm64_save_file.bin
+if [ ! -z "$save" ]; then
+  cp "$save" sm64_save_file.bin
+fi
+
+# Mesa's llvmpipe, in a virtual X server when there is no display
+export LIBGL_ALWAYS_SOFTWARE=1
+export GALLIUM_DRIVER=llvmpipe
+export vblank_mode=0
+xvfb=""
+if [ -z "$DISPLAY" ]; then
+  xvfb="xvfb-run -a"
+fi
+
+FLEXFOV_REPLAY="$inputs" \
+FLEXFOV_BENCH_FRAMES="$frames" \
+FLEXFOV_BENCH_FOV="$fov" \
+FLEXFOV_BENCH_PITCH="$pitch" \
+FLEXFOV_BENCH_OUT=../bench.csv \
+FLEXFOV_BENCH_GOLDEN="${golden:+../$golden}" \
+  $xvfb build/us_pc/sm64.us.f3dex2e | grep '^bench:' > ../bench.txt
+popd
+
+status=0
+if [ ! -z "$golden" ]; then
+  make flexfov_bench
+  ./flexfov_bench -g "$golden" >> bench.txt || status=$?
+fi
+
+cat bench.txt
+exit $status
@@ -1,12 +1,20 @@
 #include "flexfov.h"
+#include "flexfov_proj.h"
+#include "flexfov_fog.h"
+#include "flexfov_remap.h"
 
 #include <stdio.h> // import printf
+#include <stdlib.h> // import malloc, free
+#include <string.h> // import memcmp, strchr
+#include <stdint.h> // import uintptr_t
 
 #include "rendering_graph_node.h"   // import geo_process_root
 #include "src/engine/math_util.h"   // import atan2s
 #include "include/config.h"         // import SCREEN_WIDTH, SCREEN_HEIGHT
 #include "src/game/camera.h"        // import CAMERA_MODE_INSIDE_CANNON
-#include "src/game/game_init.h"     // import gDisplayListHead, gPlayer1Controller
+#include "src/game/game_init.h"     // import gDisplayListHead, gGfxPool, gGfxPoolEnd, gPlayer1Controller
+#include "src/pc/controller/controller_sdl.h"      // import controller_sdl, OSContPad
+#include "src/pc/controller/controller_keyboard.h" // import controller_keyboard
 #include "include/PR/gu.h"          // import guScaleF
 #include "include/gfx_dimensions.h" // import GFX_DIMENSIONS_FROM_LEFT_EDGE
 #include "src/game/ingame_menu.h"   // import create_dl_translation_matrix, MENU_MTX_PUSH
@@ -14,6 +22,7 @@
 #include "src/audio/external.h"     // import play_sound
 #include "include/audio_defines.h"  // import SOUND_MENU_MESSAGE_DISAPPEAR, SOUND_MENU_MESSAGE_APPEAR
 #include "include/sm64.h"           // import ACT_CREDITS_CUTSCENE
+#include "include/macros.h"         // import ALIGN8
 
 //------------------------------------------------------------------------------
 // State
@@ -23,15 +32,33 @@ static u8 flexFovOn = TRUE;
 u8 flexFovSky;
 s16 flexFovRoll;
 
-u8 flexFovSide;
-enum FLEXFOV_CUBE_SIDE {
-  FLEXFOV_CUBE_FRONT,
-  FLEXFOV_CUBE_LEFT,
-  FLEXFOV_CUBE_RIGHT,
-  FLEXFOV_CUBE_BACK,
-  FLEXFOV_CUBE_UP,
-  FLEXFOV_CUBE_DOWN
-};
+u8 flexFovSide; // see FLEXFOV_CUBE_SIDE
+
+// number of objects culled from each cubeface in the current frame (for the profiler)
+static u32 culledObjects[6];
+static u32 culledFar; // culled by the far limit from a replayed world pass, seen by every cubeface
+
+// Traverse the world once (from the front camera) and replay the resulting
+// display list on each cubeface, swapping only the projection.
+// (turning this off renders each cubeface with its own traversal,
+//  which grows the display list arena to hold six passes)
+static u8 replayFaces = TRUE;
+
+// Transform the vertices of the replayed world pass once, for all cubefaces
+// (see flexfov_replay_vertices)
+static u8 shareVertices = TRUE;
+
+// Project the shared vertices of each cubeface on worker threads
+// (see Replay workers, FLEXFOV_REPLAY_THREADS=0 turns them off)
+static u8 replayWorkers = TRUE;
+
+// Benchmark replaying recorded inputs at fixed knobs (see bench.sh)
+static u8 benchFixedFov, benchFixedPitch;
+static float benchFov, benchPitch;
+static void bench_input(void);
+void log_face_schedule(void);
+static void toggle_fast_view(void);
+static void record_tick_turn_input(void);
 
 u8 can_be_on(void) {
   // mario should be in the scene
@@ -60,6 +87,11 @@ u8 flexfov_is_on(void) {
   return flexFovOn && can_be_on();
 }
 
+// fov of each cubeface, 90° widened by its gutter (see FLEXFOV_FACE_GUTTER)
+f32 flexfov_face_fov(void) {
+  return 2.0f * atanf(1.0f + FLEXFOV_FACE_GUTTER) * 180.0f / 3.14159f;
+}
+
 // shader state
 static u8 useRubix = 0;
 static u8 useCube = 0;
@@ -68,6 +100,32 @@ static float fov = 180.0f;
 static float mobiusZoom = -1.0f;
 static u8 manualMobiusZoom = FALSE;
 
+// how the projection filters the cubefaces (see FILTER_MODE in flexfov.frag)
+enum FLEXFOV_FILTER {
+  FLEXFOV_FILTER_SS9,         // 9 nearest taps per pixel (the original supersampling)
+  FLEXFOV_FILTER_TRILINEAR,   // 1 tap from mipmapped cubefaces
+  FLEXFOV_FILTER_ANISOTROPIC, // 1 anisotropic tap from mipmapped cubefaces
+  FLEXFOV_FILTER_ADAPTIVE,    // 1 to 9 bilinear taps, depending on the texels under the pixel
+  FLEXFOV_FILTER_COUNT
+};
+static u8 filterMode = FLEXFOV_FILTER_ANISOTROPIC;
+
+// how often each cubeface is re-rendered (see the Cubeface schedule section)
+enum FLEXFOV_SCHEDULE {
+  FLEXFOV_SCHEDULE_ALL,      // every face every frame
+  FLEXFOV_SCHEDULE_FIXED,    // front every frame, left and right every other frame, the rest every 4th
+  FLEXFOV_SCHEDULE_COVERAGE, // by the share of the screen each face covers
+  FLEXFOV_SCHEDULE_COUNT
+};
+static u8 scheduleMode = FLEXFOV_SCHEDULE_COVERAGE;
+
+// time each stage of the frame (see the Profiler section)
+static u8 profileOn = FALSE;
+
+static u8 uses_mipmaps(void) {
+  return filterMode == FLEXFOV_FILTER_TRILINEAR || filterMode == FLEXFOV_FILTER_ANISOTROPIC;
+}
+
 float getMobiusZoom(void) {
   if (manualMobiusZoom) {
     return mobiusZoom;
@@ -85,12 +143,15 @@ float getMobiusZoom(void) {
 
 static u8 controlsOn = FALSE;
 static u8 zooming = FALSE;
-static float pixelSize;
 
 // button states
 static s16 rCount = 0;
 static u8 heldA = 0;
 static u8 heldB = 0;
+static u8 heldCUp = 0;
+static u8 heldCDown = 0;
+static u8 heldCLeft = 0;
+static u8 heldCRight = 0;
 
 // stick state
 static u8 waitingForCenter = FALSE;
@@ -99,6 +160,9 @@ static u8 waitingForDecenter = FALSE;
 static const float fovOffBound = 90.0f;
 
 void flexfov_update_input(void) {
+  bench_input();
+  record_tick_turn_input();
+
   if (!can_be_on()) {
     return;
   }
@@ -108,6 +172,10 @@ void flexfov_update_input(void) {
   u8 z = (gPlayer1Controller->buttonDown & Z_TRIG) > 0;
   u8 a = (gPlayer1Controller->buttonDown & A_BUTTON) > 0;
   u8 b = (gPlayer1Controller->buttonDown & B_BUTTON) > 0;
+  u8 cUp = (gPlayer1Controller->buttonDown & U_CBUTTONS) > 0;
+  u8 cDown = (gPlayer1Controller->buttonDown & D_CBUTTONS) > 0;
+  u8 cLeft = (gPlayer1Controller->buttonDown & L_CBUTTONS) > 0;
+  u8 cRight = (gPlayer1Controller->buttonDown & R_CBUTTONS) > 0;
 
   if (!z) zooming = FALSE;
   if (!r) controlsOn = FALSE;
@@ -131,8 +199,19 @@ void flexfov_update_input(void) {
   // Toggles
   if (a && !heldA) useRubix = !useRubix;
   if (b && !heldB) useCube = !useCube;
+  if (cUp && !heldCUp) filterMode = (filterMode + 1) % FLEXFOV_FILTER_COUNT;
+  if (cDown && !heldCDown) profileOn = !profileOn;
+  if (cLeft && !heldCLeft) {
+    scheduleMode = (scheduleMode + 1) % FLEXFOV_SCHEDULE_COUNT;
+    log_face_schedule();
+  }
+  if (cRight && !heldCRight) toggle_fast_view();
   heldA = a;
   heldB = b;
+  heldCUp = cUp;
+  heldCDown = cDown;
+  heldCLeft = cLeft;
+  heldCRight = cRight;
 
   // Knobs
   float stickX = gPlayer1Controller->stickX / 64.0f;
@@ -227,7 +306,13 @@ f32 dist_from_mario(Vec3f pos) {
 
 static Vec3f screenUp;
 
-void flexfov_set_cam(Vec4f *m) {
+// camera space to world space (columns: right, up, forward) and the camera position,
+// for looking up the sky panorama and reprojecting stale cubefaces
+static float camBasis[9];
+static float camPos[3];
+
+// turn the camera basis (the columns of m) toward the given cubeside
+static void rotate_to_side(Vec4f *m, u8 side) {
 #define R0(i) pR[i]
 #define U0(i) pU[i]
 #define B0(i) pB[i]
@@ -242,31 +327,151 @@ void flexfov_set_cam(Vec4f *m) {
   VSET(U0,U);
   VSET(B0,B);
 
-  camPitch = asin(-pB[1]);
-
   // overwrite camera position
-  if (flexFovSide == FLEXFOV_CUBE_FRONT) {
+  if (side == FLEXFOV_CUBE_FRONT) {
     // default
-  } else if (flexFovSide == FLEXFOV_CUBE_LEFT) {
+  } else if (side == FLEXFOV_CUBE_LEFT) {
     VSET(R,-B0);
     VSET(B, R0);
-  } else if (flexFovSide == FLEXFOV_CUBE_RIGHT) {
+  } else if (side == FLEXFOV_CUBE_RIGHT) {
     VSET(R, B0);
     VSET(B,-R0);
-  } else if (flexFovSide == FLEXFOV_CUBE_BACK) {
+  } else if (side == FLEXFOV_CUBE_BACK) {
     VSET(R,-R0);
     VSET(B,-B0);
-  } else if (flexFovSide == FLEXFOV_CUBE_DOWN) {
+  } else if (side == FLEXFOV_CUBE_DOWN) {
     VSET(B, U0);
     VSET(U,-B0);
-  } else if (flexFovSide == FLEXFOV_CUBE_UP) {
+  } else if (side == FLEXFOV_CUBE_UP) {
     VSET(B,-U0);
     VSET(U, B0);
   }
+}
+
+// rotation from front camera space to the given cubeside’s camera space
+// (i.e. front camera × rotation = cubeside camera)
+static void side_rotation(Mat4 rotation, u8 side) {
+  mtxf_identity(rotation);
+  rotate_to_side(rotation, side);
+}
 
+void flexfov_set_cam(Vec4f *m) {
+  camPitch = benchFixedPitch ? benchPitch : asin(-m[1][2]);
+  u8 i;
+  for (i=0; i<3; i++) {
+    camBasis[i]   =  m[i][0];
+    camBasis[3+i] =  m[i][1];
+    camBasis[6+i] = -m[i][2];
+    camPos[i] = -(m[3][0]*m[i][0] + m[3][1]*m[i][1] + m[3][2]*m[i][2]);
+  }
+  rotate_to_side(m, flexFovSide);
   vec3f_copy(screenUp, m[1]);
 }
 
+//------------------------------------------------------------------------------
+// Transform cache (billboards and animated parts, shared by the passes of a frame)
+//------------------------------------------------------------------------------
+
+// Without replayFaces, the scene graph is traversed once for each cubeface.
+// Billboards and animated parts come out the same on every pass (up to the
+// rotation of the cubeside), so the first pass to reach one keeps its transform
+// for the rest, keyed by graph node and object (shared layouts are drawn by many objects).
+
+#define XFORM_CACHE_SIZE 2048 // (a power of two)
+#define XFORM_CACHE_PROBES 8
+
+struct CachedTransform {
+  const void *node;
+  const void *object;
+  u32 frame;              // (entries of other frames are empty)
+  Mat4 m;                 // billboards in front camera space, animated parts in their parent's space
+  u16 *attribute;         // animation attribute that the part was read from
+  struct FlexFovAnimState anim; // animation state after the part
+};
+static struct CachedTransform xformCache[XFORM_CACHE_SIZE];
+static struct CachedTransform *xformPending; // slot of the part being computed (see flexfov_cache_anim_part)
+static u32 xformFrame;
+static u32 xformHits[6], xformMisses[6]; // of each cubeface's pass this frame (for the profiler)
+
+// inverse of each cubeside's rotation (see side_rotation)
+static const u8 inverseSide[6] = {
+  FLEXFOV_CUBE_FRONT, FLEXFOV_CUBE_RIGHT, FLEXFOV_CUBE_LEFT,
+  FLEXFOV_CUBE_BACK, FLEXFOV_CUBE_DOWN, FLEXFOV_CUBE_UP
+};
+
+static void begin_transform_cache(void) {
+  xformFrame++;
+  memset(xformHits, 0, sizeof(xformHits));
+  memset(xformMisses, 0, sizeof(xformMisses));
+}
+
+// entry of the node for this frame, or an empty slot for it (NULL if the table is crowded there)
+// (only used when there is more than one pass to share with, i.e. without replayFaces)
+static struct CachedTransform *find_transform(const void *node) {
+  const void *object = gCurGraphNodeObject;
+  u32 h = (u32)(((uintptr_t)node >> 3) ^ ((uintptr_t)object >> 3) * 0x9e3779b1u);
+  u8 i;
+  for (i=0; i<XFORM_CACHE_PROBES; i++) {
+    struct CachedTransform *t = &xformCache[(h + i) & (XFORM_CACHE_SIZE-1)];
+    if (t->frame != xformFrame) {
+      t->node = node;
+      t->object = object;
+      return t;
+    }
+    if (t->node == node && t->object == object) return t;
+  }
+  return NULL;
+}
+
+// reuse a billboard computed by an earlier pass (or set `slot` to where it should be kept)
+static u8 cached_billboard(const void *node, Mat4 dest, struct CachedTransform **slot) {
+  *slot = NULL;
+  if (replayFaces) return FALSE;
+  struct CachedTransform *t = *slot = find_transform(node);
+  if (t == NULL || t->frame != xformFrame) {
+    xformMisses[flexFovSide]++;
+    return FALSE;
+  }
+  mtxf_copy(dest, t->m);
+  rotate_to_side(dest, flexFovSide);
+  xformHits[flexFovSide]++;
+  return TRUE;
+}
+
+static void cache_billboard(struct CachedTransform *t, Mat4 dest) {
+  if (t == NULL) return;
+  mtxf_copy(t->m, dest);
+  rotate_to_side(t->m, inverseSide[flexFovSide]);
+  t->frame = xformFrame;
+}
+
+// called by geo_process_animated_part (see patch.diff)
+// (on a hit, `anim` is set to the state after the part)
+u8 flexfov_cached_anim_part(const void *node, Mat4 matrix, struct FlexFovAnimState *anim) {
+  xformPending = NULL;
+  if (!flexfov_is_on() || replayFaces) return FALSE;
+  struct CachedTransform *t = find_transform(node);
+  if (t == NULL || t->frame != xformFrame || t->attribute != anim->attribute) {
+    if (t) t->attribute = anim->attribute;
+    xformPending = t;
+    xformMisses[flexFovSide]++;
+    return FALSE;
+  }
+  mtxf_copy(matrix, t->m);
+  *anim = t->anim;
+  xformHits[flexFovSide]++;
+  return TRUE;
+}
+
+void flexfov_cache_anim_part(const void *node, Mat4 matrix, const struct FlexFovAnimState *anim) {
+  struct CachedTransform *t = xformPending;
+  if (t == NULL || t->node != node) return;
+  mtxf_copy(t->m, matrix);
+  t->anim = *anim;
+  t->frame = xformFrame;
+  xformPending = NULL;
+}
+
 //------------------------------------------------------------------------------
 // Billboards
 //------------------------------------------------------------------------------
@@ -274,7 +479,10 @@ void flexfov_set_cam(Vec4f *m) {
 // CYLBOARDS (billboards swiveling on a cylinder axis)
 // i.e. upright and swiveling on vertical axis to face camera
 // e.g. trees
-void flexfov_mtxf_cylboard(Mat4 dest, Mat4 src, Vec3f pos, Vec3f cam) {
+void flexfov_mtxf_cylboard(const void *node, Mat4 dest, Mat4 src, Vec3f pos, Vec3f cam) {
+  struct CachedTransform *t;
+  if (cached_billboard(node, dest, &t)) return;
+
   Mat4 mtxf;
   mtxf_translate(mtxf, pos);
 
@@ -295,11 +503,15 @@ void flexfov_mtxf_cylboard(Mat4 dest, Mat4 src, Vec3f pos, Vec3f cam) {
   mtxf[2][2] = dz;
 
   mtxf_mul(dest, mtxf, src);
+  cache_billboard(t, dest);
 }
 
 // BALLBOARDS (billboards tangent to a ball around the camera)
 // e.g. coins, flames, bubbles, clouds
-void flexfov_mtxf_ballboard(Mat4 dest, Mat4 src, Vec3f pos) {
+void flexfov_mtxf_ballboard(const void *node, Mat4 dest, Mat4 src, Vec3f pos) {
+  struct CachedTransform *t;
+  if (cached_billboard(node, dest, &t)) return;
+
   // set screen space position of billboard
   Mat4 mtxf;
   mtxf_translate(mtxf, pos);
@@ -322,423 +534,3576 @@ void flexfov_mtxf_ballboard(Mat4 dest, Mat4 src, Vec3f pos) {
   vec3f_copy(dest[0], right);
   vec3f_copy(dest[1], up);
   vec3f_copy(dest[2], forward);
+  cache_billboard(t, dest);
 }
 
 //------------------------------------------------------------------------------
-// cubemap setup and rendering
+// Culling
 //------------------------------------------------------------------------------
 
-// from gfx_pc.c
-extern void gfx_get_dimensions(uint32_t *width, uint32_t *height);
-extern void gfx_flush(void);
-extern void gfx_sp_reset(void);
+// Objects straddling a seam must be drawn on both cubefaces, so we pad the
+// culling radius a little to keep them from popping in and out at the edges.
+static const f32 cullGuard = 100.0f;
 
-#if FOR_WINDOWS || defined(TARGET_OSX)
-#define GLEW_STATIC
-#include <OpenGL/gl3.h>
-#endif
+// Vanilla culling tests against the single screen frustum.
+// We test against the frustum of the cubeface currently being rendered
+// (90° and its gutter, see FLEXFOV_FACE_GUTTER).
+s32 flexfov_obj_is_in_view(struct GraphNodeObject *node, Mat4 matrix) {
+  struct GraphNode *geo = node->sharedChild;
+  s16 cullingRadius = 300;
+  if (geo != NULL && geo->type == GRAPH_NODE_TYPE_CULLING_RADIUS) {
+    cullingRadius = ((struct GraphNodeCullingRadius *) geo)->cullingRadius;
+  }
+  f32 r = cullingRadius + cullGuard;
 
-#include <SDL2/SDL.h>
+  // object position in cubeface camera space (looking down -z)
+  f32 x = matrix[3][0];
+  f32 y = matrix[3][1];
+  f32 depth = -matrix[3][2];
 
-#define GL_GLEXT_PROTOTYPES 1
-#ifdef USE_GLES
-#include <SDL2/SDL_opengles2.h>
-#else
-#include <SDL2/SDL_opengl.h>
-#endif
+  // A replayed world pass is seen by every cubeface, so only the far limit applies,
+  // using the depth on whichever cubeface the object is centered in.
+  if (replayFaces) {
+    f32 ax = fabsf(x), ay = fabsf(y), az = fabsf(depth);
+    f32 maxDepth = ax > ay ? (ax > az ? ax : az) : (ay > az ? ay : az);
+    u8 inView = maxDepth < 20000.0f + cullingRadius;
+    if (!inView) culledFar++;
+    return inView;
+  }
+
+  // keep the vanilla far limit (deeper objects overflow the fixed point matrix)
+  u8 inView = depth < 20000.0f + cullingRadius;
+
+  // the four side planes are |x| = w depth and |y| = w depth,
+  // so the distance from the object to the nearest one is (|x| - w depth)/√(1 + w²)
+  const f32 w = 1.0f + FLEXFOV_FACE_GUTTER;
+  f32 toPlane = 1.0f / sqrtf(1.0f + w*w);
+  inView = inView &&
+    (fabsf(x) - w*depth) * toPlane < r &&
+    (fabsf(y) - w*depth) * toPlane < r;
+
+  if (!inView) culledObjects[flexFovSide]++;
+  return inView;
+}
+
+//------------------------------------------------------------------------------
+// Cubeface usage (the parts of the cubemap sampled by the projection)
+//------------------------------------------------------------------------------
+
+// from gfx_pc.c
+extern void gfx_get_dimensions(uint32_t *width, uint32_t *height);
 
-// names
-static GLuint frameBuffer;
-static GLuint cubeTextureColor;
-static GLuint cubeTextureDepth;
-
-static GLenum cubesidesGL[6] = {
-  // SM64 and OpenGL texture cube map have same coord systems
-  /* FLEXFOV_CUBE_FRONT */  GL_TEXTURE_CUBE_MAP_POSITIVE_Z,
-  /* FLEXFOV_CUBE_LEFT  */  GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
-  /* FLEXFOV_CUBE_RIGHT */  GL_TEXTURE_CUBE_MAP_POSITIVE_X,
-  /* FLEXFOV_CUBE_BACK  */  GL_TEXTURE_CUBE_MAP_NEGATIVE_Z,
-  /* FLEXFOV_CUBE_UP    */  GL_TEXTURE_CUBE_MAP_POSITIVE_Y,
-  /* FLEXFOV_CUBE_DOWN  */  GL_TEXTURE_CUBE_MAP_NEGATIVE_Y
+// region of a cubeface sampled by the projection (in texture coords 0 to 1)
+struct FaceUsage {
+  u8 used;
+  float s0, t0, s1, t1;
+  float step; // distance between neighboring samples
+  float minStep; // smallest pixel footprint (where the face is most magnified), 0 if unknown
+  float coverage; // share of the screen that samples the face
 };
+static struct FaceUsage faceUsage[6];
+static u32 usageVersion; // incremented whenever the usage is recomputed
 
-static void set_tex_params(void) {
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+// render every face whole, every frame, whatever the projection samples
+// (for recording the cubemap, see Capture)
+static u8 wholeCube;
+
+// what the usage was computed for (recomputed when these change)
+static struct FlexFovKnobs usageKnobs;
+static u32 usageWidth, usageHeight;
+
+// pitch of the camera about to be rendered
+// (flexfov_set_cam only sees it after we have decided which faces to render)
+static float next_cam_pitch(void) {
+  f32 dx = gLakituState.focus[0] - gLakituState.pos[0];
+  f32 dy = gLakituState.focus[1] - gLakituState.pos[1];
+  f32 dz = gLakituState.focus[2] - gLakituState.pos[2];
+  f32 dist = sqrtf(dx*dx + dy*dy + dz*dz);
+  if (benchFixedPitch) return benchPitch;
+  return dist > 0.0f ? asinf(dy/dist) : camPitch;
 }
 
-void flexfov_resize_cubemap(void) {
-  // TEXTURES
-  // texture size
-  u32 w, h;
-  gfx_get_dimensions(&w, &h);
+struct UsageSample {
+  s8 side; // -1 if blank
+  float s, t;
+};
 
-  // Allocate COLOR textures
-  glBindTexture(GL_TEXTURE_CUBE_MAP, cubeTextureColor);
-  u8 i;
-  for (i=0; i<6; i++) {
-    GLenum cubesideGL = cubesidesGL[i];
-    glTexImage2D(cubesideGL, 0, GL_RGBA, h, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-    set_tex_params();
+static struct UsageSample sample_usage(float u, float v) {
+  struct UsageSample p = { -1, 0.0f, 0.0f };
+  float ray[3];
+  if (flexfov_uv_to_ray(&usageKnobs, u, v, ray)) {
+    p.side = flexfov_ray_to_cubeside(ray, &p.s, &p.t);
+    struct FaceUsage *f = &faceUsage[p.side];
+    if (!f->used) {
+      f->used = TRUE;
+      f->s0 = f->s1 = p.s;
+      f->t0 = f->t1 = p.t;
+    }
+    if (p.s < f->s0) f->s0 = p.s;
+    if (p.s > f->s1) f->s1 = p.s;
+    if (p.t < f->t0) f->t0 = p.t;
+    if (p.t > f->t1) f->t1 = p.t;
   }
+  return p;
+}
 
-  // Allocate DEPTH textures
-  glBindTexture(GL_TEXTURE_CUBE_MAP, cubeTextureDepth);
-  for (i=0; i<6; i++) {
-    GLenum cubesideGL = cubesidesGL[i];
-    glTexImage2D(cubesideGL, 0, GL_DEPTH_COMPONENT24, h, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
-    set_tex_params();
+// Neighboring samples on different faces have a seam between them,
+// so we walk toward it to find how far each face extends.
+static void sample_seam(float u0, float v0, struct UsageSample p0, float u1, float v1, struct UsageSample p1) {
+  u8 i;
+  for (i=0; i<6 && p0.side != p1.side; i++) {
+    float u = (u0+u1)*0.5f;
+    float v = (v0+v1)*0.5f;
+    struct UsageSample p = sample_usage(u, v);
+    if (p.side == p0.side) { u0 = u; v0 = v; p0 = p; }
+    else                   { u1 = u; v1 = v; p1 = p; }
   }
 }
 
-static void create_cubemap(void) {
-  // OBJECTS
-  // Create frame buffer object
-  glGenFramebuffers(1, &frameBuffer);
-
-  // Create cube texture objects
-  glGenTextures(1, &cubeTextureColor);
-  glGenTextures(1, &cubeTextureDepth);
-  flexfov_resize_cubemap();
+// returns the distance per screen pixel (or 0 if the samples are on different faces)
+static float sample_step(struct UsageSample a, struct UsageSample b, float pixels) {
+  if (a.side < 0 || a.side != b.side) return 0.0f;
+  float ds = fabsf(a.s - b.s);
+  float dt = fabsf(a.t - b.t);
+  float step = ds > dt ? ds : dt;
+  if (step > faceUsage[a.side].step) faceUsage[a.side].step = step;
+  return step / pixels;
+}
 
-  // OPTIONS
-  // enable seamless global option
-  glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+// The footprint of a screen pixel on its cubeface is the larger of its
+// horizontal and vertical steps (like mipmap level selection), so the
+// face only needs full detail where that is smallest.
+static void sample_footprint(struct UsageSample p, float stepX, float stepY) {
+  if (stepX == 0.0f || stepY == 0.0f) return;
+  struct FaceUsage *f = &faceUsage[p.side];
+  float footprint = stepX > stepY ? stepX : stepY;
+  if (f->minStep == 0.0f || footprint < f->minStep) f->minStep = footprint;
 }
 
-static void restore_viewport(void) {
+#define USAGE_COLS 64
+#define USAGE_ROWS 48
+
+// Find which parts of each cubeface are sampled by the projection,
+// by sampling a grid of rays across the screen.
+static void update_face_usage(void) {
   u32 w, h;
   gfx_get_dimensions(&w, &h);
+  struct FlexFovKnobs knobs = { fov, next_cam_pitch(), getMobiusZoom(), useCube };
+  if (w == usageWidth && h == usageHeight && memcmp(&knobs, &usageKnobs, sizeof(knobs)) == 0) {
+    return;
+  }
+  usageKnobs = knobs;
+  usageWidth = w;
+  usageHeight = h;
+  usageVersion++;
 
-  // opengl
-  glViewport(0,0,w,h);
-  glScissor(0,0,w,h);
+  u8 i;
+  for (i=0; i<6; i++) {
+    faceUsage[i].used = FALSE;
+    faceUsage[i].step = 0.0f;
+    faceUsage[i].minStep = 0.0f;
+    faceUsage[i].coverage = 0.0f;
+  }
 
-  // rdp
-  gfx_current_dimensions.width = w;
-  gfx_current_dimensions.height = h;
-  gfx_current_dimensions.aspect_ratio = (float)w / (float)h;
-}
+  // sample a little past the screen edges to cover the supersampling taps
+  float uMax, vMax;
+  flexfov_aspect_uv(w, h, &uMax, &vMax);
+  float halfPixel = uMax/w;
+  uMax += halfPixel;
+  vMax += halfPixel;
 
-static void set_cubeside_viewport(void) {
-  u32 w, h;
-  gfx_get_dimensions(&w, &h);
+  // screen pixels between neighboring samples
+  float colPixels = uMax/USAGE_COLS/halfPixel;
+  float rowPixels = vMax/USAGE_ROWS/halfPixel;
+
+  static struct UsageSample prevRow[USAGE_COLS+1];
+  s32 col, row;
+  for (row=0; row<=USAGE_ROWS; row++) {
+    float v = -vMax + 2.0f*vMax*row/USAGE_ROWS;
+    float vPrev = -vMax + 2.0f*vMax*(row-1)/USAGE_ROWS;
+    struct UsageSample left;
+    for (col=0; col<=USAGE_COLS; col++) {
+      float u = -uMax + 2.0f*uMax*col/USAGE_COLS;
+      float uPrev = -uMax + 2.0f*uMax*(col-1)/USAGE_COLS;
+      struct UsageSample p = sample_usage(u, v);
+      float stepX = 0.0f, stepY = 0.0f;
+      if (col > 0) {
+        sample_seam(uPrev, v, left, u, v, p);
+        stepX = sample_step(left, p, colPixels);
+      }
+      if (row > 0) {
+        sample_seam(u, vPrev, prevRow[col], u, v, p);
+        stepY = sample_step(prevRow[col], p, rowPixels);
+      }
+      sample_footprint(p, stepX, stepY);
+      if (p.side >= 0) faceUsage[p.side].coverage += 1.0f / ((USAGE_COLS+1) * (USAGE_ROWS+1));
+      prevRow[col] = left = p;
+    }
+  }
 
-  glViewport(0,0,h,h);
+  // the sampled region can extend up to a grid step past the outermost samples
+  for (i=0; i<6; i++) {
+    struct FaceUsage *f = &faceUsage[i];
+    if (!f->used) continue;
+    f->s0 = f->s0 - f->step < 0.0f ? 0.0f : f->s0 - f->step;
+    f->t0 = f->t0 - f->step < 0.0f ? 0.0f : f->t0 - f->step;
+    f->s1 = f->s1 + f->step > 1.0f ? 1.0f : f->s1 + f->step;
+    f->t1 = f->t1 + f->step > 1.0f ? 1.0f : f->t1 + f->step;
+  }
 
-  // rdp
-  gfx_current_dimensions.width = h;
-  gfx_current_dimensions.height = h;
-  gfx_current_dimensions.aspect_ratio = 1.0f;
+  // (unsampled faces are then sized like the largest, see update_face_sizes)
+  if (wholeCube) {
+    for (i=0; i<6; i++) {
+      struct FaceUsage *f = &faceUsage[i];
+      f->used = TRUE;
+      f->s0 = f->t0 = 0.0f;
+      f->s1 = f->t1 = 1.0f;
+    }
+  }
 }
 
-static u8 currSideGl;
+//------------------------------------------------------------------------------
+// Cubeface sizes (chosen from the pixel density of the projection)
+//------------------------------------------------------------------------------
 
-static void init_cubeside(u8 side) {
-  currSideGl = side;
-  set_cubeside_viewport();
+// texels per screen pixel where a cubeface is most magnified
+// (0.6 gives the front face about the detail of the old window-height faces at 90°,
+//  while the faces squeezed by wider projections shrink to match)
+static float faceScale = 0.6f;
 
-  GLenum cubesideGL = cubesidesGL[side];
-	GLenum attachments[2] = {GL_COLOR_ATTACHMENT0, GL_NONE};
+// sizes are rounded up to this, so small knob changes don't reallocate textures
+#define FACE_SIZE_STEP 32
 
-  glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, cubesideGL, cubeTextureColor, 0);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cubesideGL, cubeTextureDepth, 0);
-  glDrawBuffers(2, attachments);
+static u32 maxFaceSize = 2048; // queried from OpenGL
+static u32 faceSize[6];        // width and height of each cubeface (0 if unused)
 
-  glDisable(GL_SCISSOR_TEST);
-  glDepthMask(GL_TRUE); // Must be set to clear Z-buffer
-  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glEnable(GL_SCISSOR_TEST);
+// Dragging the window (or scrolling the fov) changes the sizes every frame,
+// so a face keeps rendering at its current size until its new size has held
+// for this many frames, and is then reallocated once.
+#define RESIZE_SETTLE_FRAMES 15
+static u32 renderSize[6]; // size each face is rendered at (faceSize once it settles)
+static u32 settlingSize[6];
+static u8 settlingFrames[6];
 
-  // Objects rendered to FBO will not blend correctly with previous contents without this:
-  // https://stackoverflow.com/a/18497511/142317
-  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+static void settle_face_sizes(void) {
+  u8 i;
+  for (i=0; i<6; i++) {
+    u32 target = faceSize[i];
+    if (target == renderSize[i] || target == 0) {
+      settlingFrames[i] = 0;
+      continue;
+    }
+    if (target != settlingSize[i]) {
+      settlingSize[i] = target;
+      settlingFrames[i] = 0;
+    }
+    // (a face with nothing to keep is sized right away)
+    if (renderSize[i] == 0 || ++settlingFrames[i] >= RESIZE_SETTLE_FRAMES) {
+      renderSize[i] = target;
+      settlingFrames[i] = 0;
+    }
+  }
 }
 
-void flexfov_set_light_direction(Light_t *light) {
-  // Light is always constant relative to the camera angle.
-  // So we have to force the same light direction for all cubefaces.
+// scale of faceScale held by the dynamic resolution controller (see Dynamic resolution)
+static float resolutionScale = 1.0f;
 
-  if (!flexfov_is_on()) return;
+static void update_face_sizes(void) {
+  float scale = faceScale * resolutionScale;
 
-  s8 x0=light->dir[0], y0=light->dir[1], z0=light->dir[2];
-  s8 x,y,z;
+  // (only the stretched poles of Mercator ask for more texels than the window is wide)
+  u32 maxSize = usageWidth > usageHeight ? usageWidth : usageHeight;
+  maxSize = (u32)(maxSize * scale);
+  if (maxSize > maxFaceSize) maxSize = maxFaceSize;
 
-  switch (currSideGl) {
-    case FLEXFOV_CUBE_FRONT: x =  x0; y =  y0; z =  z0; break;
-    case FLEXFOV_CUBE_LEFT:  x = -z0; y =  y0; z =  x0; break;
-    case FLEXFOV_CUBE_RIGHT: x =  z0; y =  y0; z = -x0; break;
-    case FLEXFOV_CUBE_BACK:  x = -x0; y =  y0; z = -z0; break;
-    case FLEXFOV_CUBE_UP:    x =  x0; y =  z0; z = -y0; break;
-    case FLEXFOV_CUBE_DOWN:  x =  x0; y = -z0; z =  y0; break;
+  u32 largest = FACE_SIZE_STEP;
+  u8 i;
+  for (i=0; i<6; i++) {
+    struct FaceUsage *f = &faceUsage[i];
+    faceSize[i] = 0;
+    if (!f->used || f->minStep == 0.0f) continue;
+    float size = ceilf(scale / f->minStep);
+    u32 s = size < (float)maxSize ? (u32)size : maxSize;
+    s = (s + FACE_SIZE_STEP-1) / FACE_SIZE_STEP * FACE_SIZE_STEP;
+    if (s > maxSize) s = maxSize;
+    faceSize[i] = s;
+    if (s > largest) largest = s;
   }
 
-  light->dir[0] = x;
-  light->dir[1] = y;
-  light->dir[2] = z;
+  // faces only seen in slivers between samples have no density estimate
+  for (i=0; i<6; i++) {
+    if (faceUsage[i].used && faceSize[i] == 0) faceSize[i] = largest;
+  }
 }
 
-static float near, far;
-void flexfov_set_fog_planes(struct GraphNodePerspective *node) {
-  if (!flexfov_is_on()) return;
-  near = node->near;
-  far = node->far;
+void log_face_usage(void) {
+  u8 i;
+  for (i=0; i<6; i++) {
+    struct FaceUsage *f = &faceUsage[i];
+    if (f->used) printf("face %d: %dx%d s=(%.2f %.2f) t=(%.2f %.2f)\n", i, faceSize[i], faceSize[i], f->s0, f->s1, f->t0, f->t1);
+    else printf("face %d: unused\n", i);
+  }
 }
 
-void flexfov_set_fog_scale(float m[4][4], float v[3], float *z, float *w) {
-  // Fog is scaled based on z-distance to the screen’s near plane.
-  // For consistency across cubefaces, we scale it based on actual distance to the camera.
+//------------------------------------------------------------------------------
+// Dynamic resolution (scaling the cubefaces to hold a frame time)
+//------------------------------------------------------------------------------
 
-  if (!flexfov_is_on()) return;
+// Environment:
+//   FLEXFOV_TARGET_MS=ms    frame time to hold (turns the controller on)
+//   FLEXFOV_SCALE_MIN=x     smallest resolutionScale (default 0.5)
+//   FLEXFOV_SCALE_MAX=x     largest resolutionScale (default 1)
+//
+// The frame times are the CPU and GPU times of our passes, read back from the
+// profiler's timestamps. Face resolution only changes the GPU time, so the scale
+// only comes down when the GPU is over the target and behind the CPU.
+// It is adjusted once per window of frames, in steps, and the faces then
+// settle to their new sizes (see settle_face_sizes), so textures aren't
+// reallocated every frame.
+
+#define RES_WINDOW_FRAMES 30
+#define RES_SCALE_STEP 0.05f
+#define RES_MAX_CHANGE 0.2f  // of the scale per adjustment
+#define RES_HEADROOM 0.8f    // of the target, below which the scale goes up
 
-  // get distance to the camera
-  float dx = v[0] * m[0][0] + v[1] * m[1][0] + v[2] * m[2][0] + m[3][0];
-  float dy = v[0] * m[0][1] + v[1] * m[1][1] + v[2] * m[2][1] + m[3][1];
-  float dz = v[0] * m[0][2] + v[1] * m[1][2] + v[2] * m[2][2] + m[3][2];
-  float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+static u8 resolutionOn;
+static float resolutionTarget; // ms
+static float resolutionMin = 0.5f, resolutionMax = 1.0f;
+static double resolutionCpu, resolutionGpu; // ms summed over the window
+static u32 resolutionFrames;
 
-  // Get the non-linear normalization of this distance (z/w)
-  // by passing the point (0,0,-dist) through the projection matrix.
-  //
-  //   float u[3] = {0.0f, 0.0f, dist};
-  //   x = u[0] * p[0][0] + u[1] * p[1][0] + u[2] * p[2][0] + p[3][0];
-  //   y = u[0] * p[0][1] + u[1] * p[1][1] + u[2] * p[2][1] + p[3][1];
-  //   z = u[0] * p[0][2] + u[1] * p[1][2] + u[2] * p[2][2] + p[3][2];
-  //   w = u[0] * p[0][3] + u[1] * p[1][3] + u[2] * p[2][3] + p[3][3];
-  //
-  //   This simplifies to the following:
-  *z = (-dist*(near+far) + 2*near*far) / (near-far);
-  *w = dist;
+static void init_resolution_scale(void) {
+  const char *target = getenv("FLEXFOV_TARGET_MS");
+  const char *min = getenv("FLEXFOV_SCALE_MIN");
+  const char *max = getenv("FLEXFOV_SCALE_MAX");
+  if (min) resolutionMin = atof(min);
+  if (max) resolutionMax = atof(max);
+  if (resolutionMin < RES_SCALE_STEP) resolutionMin = RES_SCALE_STEP;
+  if (resolutionMax < resolutionMin) resolutionMax = resolutionMin;
+  if (target && atof(target) > 0.0) {
+    resolutionOn = TRUE;
+    resolutionTarget = atof(target);
+    printf("resolution: holding %.1fms with scale %.2f to %.2f\n", resolutionTarget, resolutionMin, resolutionMax);
+  }
 }
 
-//------------------------------------------------------------------------------
-// projection setup and rendering
-//------------------------------------------------------------------------------
+void log_resolution_scale(void) {
+  printf("resolution: scale=%.2f (face scale %.2f)\n", resolutionScale, faceScale * resolutionScale);
+}
 
-GLuint quadProg;
-GLint quadAttrXY;
-GLint quadAttrUV;
-GLint quadCamPitch;
-GLint quadUseRubix;
-GLint quadUseCube;
-GLint quadFov;
-GLint quadMobiusZoom;
-GLint quadControlsOn;
-GLint quadZooming;
-GLint quadPixelSize;
+// called with the times of each frame read back by the profiler
+static void update_resolution_scale(float cpu, float gpu) {
+  if (!resolutionOn) return;
+  resolutionCpu += cpu;
+  resolutionGpu += gpu;
+  if (++resolutionFrames < RES_WINDOW_FRAMES) return;
+  cpu = (float)(resolutionCpu / resolutionFrames);
+  gpu = (float)(resolutionGpu / resolutionFrames);
+  resolutionCpu = resolutionGpu = 0.0;
+  resolutionFrames = 0;
 
-// Z depths:
-//  * sky = -0.33
-//  * hud = -1
-//  * pause = 0
+  u8 over = gpu > resolutionTarget && gpu > cpu;
+  u8 under = gpu < resolutionTarget * RES_HEADROOM;
+  if (!over && !under) return;
 
-static GLfloat quadVerts[] = {
-// x      y     u     v
-// (clip space) (aspect-normalized texture space)
-  -1.0f, -1.0f, 0.0f, 0.0f, // bottom left
-   1.0f, -1.0f, 0.0f, 0.0f, // bottom right
-  -1.0f,  1.0f, 0.0f, 0.0f, // top left
+  // GPU time goes with the texels rendered, i.e. the square of the scale
+  // (aiming for the middle of the band between the headroom and the target)
+  float aim = resolutionTarget * (1.0f + RES_HEADROOM) * 0.5f;
+  float change = sqrtf(aim / (gpu > 0.01f ? gpu : 0.01f));
+  if (change < 1.0f - RES_MAX_CHANGE) change = 1.0f - RES_MAX_CHANGE;
+  if (change > 1.0f + RES_MAX_CHANGE) change = 1.0f + RES_MAX_CHANGE;
+  float scale = roundf(resolutionScale * change / RES_SCALE_STEP) * RES_SCALE_STEP;
+  if (scale < resolutionMin) scale = resolutionMin;
+  if (scale > resolutionMax) scale = resolutionMax;
+  if (scale == resolutionScale) return;
 
-  -1.0f,  1.0f, 0.0f, 0.0f, // top left
-   1.0f,  1.0f, 0.0f, 0.0f, // top right
-   1.0f, -1.0f, 0.0f, 0.0f  // bottom right
-};
-static const u8 numQuadVerts = 6;
-static const u8 quadStride = 4;
+  resolutionScale = scale;
+  printf("resolution: scale=%.2f (cpu=%.1fms gpu=%.1fms target=%.1fms)\n", scale, cpu, gpu, resolutionTarget);
+}
 
-static const char *quadFragSrc=
-#include "flexfov.frag"
-;
+//------------------------------------------------------------------------------
+// Cubeface schedule (re-rendering the less visible cubefaces less often)
+//------------------------------------------------------------------------------
 
-static const char *quadVertSrc =
-"#version 110\n"
-"\n"
-"attribute vec2 aXY;\n"
-"attribute vec2 aUV;\n"
-"varying vec2 vUV;\n"
-"\n"
-"void main(void)\n"
-"{\n"
-"  vUV = aUV;\n"
-"  gl_Position = vec4(aXY, 1.0, 1.0);\n"
-"}\n"
-;
+// A face that is skipped keeps its last image, which the projection moves to
+// the current camera using the face's depth (see reproject in flexfov.frag).
 
-static void create_quad(void) {
+// frames between renders of each face for FLEXFOV_SCHEDULE_FIXED (see FLEXFOV_CUBE_SIDE)
+static const u8 fixedIntervals[6] = { 1, 2, 2, 4, 4, 4 };
 
-  // CREATE SHADER PROGRAM
+// frames between renders for FLEXFOV_SCHEDULE_COVERAGE
+// (a face covering at least this share of the screen gets this interval)
+static const float coverageShares[3] = { 0.25f, 0.05f, 0.0f };
+static const u8 coverageIntervals[3] = { 1, 2, 4 };
 
-  GLint success;
+// re-render a face early once the camera has turned or moved this far since its last render
+// (past this, reprojection shows holes behind objects and past the scissored region)
+static float maxStaleAngle = 10.0f; // degrees
+static float maxStaleDistance = 150.0f;
 
-  // Vertex Shader
-  GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vertex_shader, 1, &quadVertSrc, NULL);
-  glCompileShader(vertex_shader);
-  glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-      GLint max_length = 0;
-      glGetShaderiv(vertex_shader, GL_INFO_LOG_LENGTH, &max_length);
-      char error_log[1024];
-      printf("Quad Vertex shader compilation failed\n");
-      glGetShaderInfoLog(vertex_shader, max_length, &max_length, &error_log[0]);
-      printf("%s\n", &error_log[0]);
-      abort();
-  }
+struct FaceSchedule {
+  u8 interval;    // frames between renders
+  u8 render;      // rendered this frame
+  u32 age;        // frames since the last render
+  u32 size;       // size of the last render
+  u8 keptDepth;   // the last render kept its depth (see init_cubeside)
+  float basis[9]; // camera of the last render (see camBasis)
+  float pos[3];
+  float far;      // far plane of the last render (for reading its depth)
+};
+static struct FaceSchedule faceSchedule[6];
+static u32 scheduleFrame;
+static u32 scheduleUsage; // usage version of the last renders
+static u8 scheduleValid;  // faces hold the images of the last renders (FALSE after flexfov was off)
 
-  // Fragment Shader
-  GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fragment_shader, 1, &quadFragSrc, NULL);
-  glCompileShader(fragment_shader);
-  glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
-  if (!success) {
-      GLint max_length = 0;
-      glGetShaderiv(fragment_shader, GL_INFO_LOG_LENGTH, &max_length);
-      char error_log[1024];
-      printf("Quad Fragment shader compilation failed\n");
-      glGetShaderInfoLog(fragment_shader, max_length, &max_length, &error_log[0]);
-      printf("%s\n", &error_log[0]);
-      abort();
+static u8 face_interval(u8 side) {
+  u8 i = 0;
+  if (wholeCube) return 1;
+  switch (scheduleMode) {
+    case FLEXFOV_SCHEDULE_FIXED:
+      return fixedIntervals[side];
+    case FLEXFOV_SCHEDULE_COVERAGE:
+      while (coverageShares[i] > 0.0f && faceUsage[side].coverage < coverageShares[i]) i++;
+      return coverageIntervals[i];
   }
+  return 1;
+}
 
-  // Program
-  quadProg = glCreateProgram();
-  glAttachShader(quadProg, vertex_shader);
-  glAttachShader(quadProg, fragment_shader);
-  glLinkProgram(quadProg);
-  glDeleteShader(vertex_shader);
-  glDeleteShader(fragment_shader);
-
-  // Attribs
-  quadAttrXY = glGetAttribLocation(quadProg, "aXY");
-  quadAttrUV = glGetAttribLocation(quadProg, "aUV");
-
-  // Uniforms
-  quadCamPitch = glGetUniformLocation(quadProg, "camPitch");
-  quadUseRubix = glGetUniformLocation(quadProg, "useRubix");
-  quadUseCube = glGetUniformLocation(quadProg, "useCube");
-  quadFov = glGetUniformLocation(quadProg, "fov");
-  quadMobiusZoom = glGetUniformLocation(quadProg, "mobiusZoom");
-  quadControlsOn = glGetUniformLocation(quadProg, "controlsOn");
-  quadZooming = glGetUniformLocation(quadProg, "zooming");
-  quadPixelSize = glGetUniformLocation(quadProg, "pixelSize");
+static u8 face_is_too_stale(struct FaceSchedule *f) {
+  // (compare forward vectors)
+  float turn = f->basis[6]*camBasis[6] + f->basis[7]*camBasis[7] + f->basis[8]*camBasis[8];
+  float dx = camPos[0] - f->pos[0];
+  float dy = camPos[1] - f->pos[1];
+  float dz = camPos[2] - f->pos[2];
+  return turn < cosf(maxStaleAngle / 180.0f * 3.14159f) ||
+    dx*dx + dy*dy + dz*dz > maxStaleDistance * maxStaleDistance;
 }
 
-// set aspect-normalized uv
-static void update_aspect(u32 w, u32 h) {
-  float aspect=(float)w/(float)h;
-  float defaultAspect=4.0f/3.0f;
-  float u,v;
-  if (aspect < defaultAspect) {
-    // narrow
-    v = 1.0f/defaultAspect;
-    u = v*aspect;
-  } else {
-    // wide
-    u = aspect/defaultAspect;
-    v = 1.0f/defaultAspect;
+// choose the faces to render this frame
+// (staggered, so that faces with the same interval take turns)
+static void schedule_faces(void) {
+  settle_face_sizes();
+  u8 fresh = scheduleValid && scheduleUsage == usageVersion;
+  u8 i;
+  for (i=0; i<6; i++) {
+    struct FaceSchedule *f = &faceSchedule[i];
+    f->interval = face_interval(i);
+    f->render = faceUsage[i].used && (
+      !fresh ||
+      !f->keptDepth ||
+      f->size != renderSize[i] ||
+      f->age >= f->interval ||
+      (scheduleFrame + i) % f->interval == 0 ||
+      face_is_too_stale(f));
   }
-  pixelSize = u/w/2.0f;
+  scheduleFrame++;
+}
 
-  // update quadVerts with aspect-normalized uv
+// remember the camera of the faces rendered this frame (once the world traversal has set it)
+static void stamp_faces(float far) {
   u8 i;
-  for (i=0; i<numQuadVerts; i++) {
-    u8 j = i*quadStride;
-    quadVerts[j+2] = quadVerts[j]*u;
-    quadVerts[j+3] = quadVerts[j+1]*v;
+  for (i=0; i<6; i++) {
+    struct FaceSchedule *f = &faceSchedule[i];
+    if (!f->render) {
+      f->age++;
+      continue;
+    }
+    f->age = 0;
+    f->size = renderSize[i];
+    memcpy(f->basis, camBasis, sizeof(f->basis));
+    memcpy(f->pos, camPos, sizeof(f->pos));
+    f->far = far;
   }
+  scheduleUsage = usageVersion;
+  scheduleValid = TRUE;
 }
 
-static void render_quad(void) {
-  restore_viewport();
+void log_face_schedule(void) {
+  static const char *names[FLEXFOV_SCHEDULE_COUNT] = { "all", "fixed", "coverage" };
+  printf("face schedule: %s\n", names[scheduleMode]);
+  u8 i;
+  for (i=0; i<6; i++) {
+    struct FaceSchedule *f = &faceSchedule[i];
+    if (faceUsage[i].used) printf("face %d: every %d frames, age %u, coverage %.3f\n", i, f->interval, f->age, faceUsage[i].coverage);
+  }
+}
+
+//------------------------------------------------------------------------------
+// cubemap setup and rendering
+//------------------------------------------------------------------------------
+
+// from gfx_pc.c
+extern void gfx_flush(void);
+extern void gfx_sp_reset(void);
+
+#if FOR_WINDOWS || defined(TARGET_OSX)
+#define GLEW_STATIC
+#include <OpenGL/gl3.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#define GL_GLEXT_PROTOTYPES 1
+#ifdef USE_GLES
+#include <SDL2/SDL_opengles2.h>
+#else
+#include <SDL2/SDL_opengl.h>
+#endif
+
+// GL state shadows: the state that flexfov sets (bound textures, framebuffer attachments,
+// uniforms) is remembered, and calls that wouldn't change it are skipped. Each shadowed
+// call site goes through gl_state_same, which counts the calls made and skipped there
+// for the profiler, and FLEXFOV_GL_SHADOW=0 makes them all, so that the saving can be
+// measured with the same counters.
+static u8 glShadows = TRUE;
+static void count_gl_state(u8 skipped, u32 calls);
+
+// whether the `calls` that would set some state can be skipped, as it's already `same`
+static u8 gl_state_same(u8 same, u32 calls) {
+  u8 skip = same && glShadows;
+  count_gl_state(skip, calls);
+  return skip;
+}
+
+static void init_gl_shadows(void) {
+  const char *shadow = getenv("FLEXFOV_GL_SHADOW");
+  if (shadow) glShadows = atoi(shadow) != 0;
+}
+
+// texture bound to each of our texture units
+// (the renderer only uses units 0 and 1, so these stay bound between frames)
+static GLuint unitTextures[17]; // (up to overlayUnit)
+static u8 unitActive; // we left one of our units active (see reset_active_unit)
+
+// bind a texture for sampling (skipped if it is already bound)
+static void bind_unit(GLint unit, GLuint tex) {
+  if (gl_state_same(unitTextures[unit] == tex, 2)) return;
+  unitTextures[unit] = tex;
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_2D, tex);
+  unitActive = TRUE;
+}
+
+// make a unit active with a texture bound, for changing the texture
+static void edit_unit(GLint unit, GLuint tex) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  unitActive = TRUE;
+  if (gl_state_same(unitTextures[unit] == tex, 1)) return;
+  unitTextures[unit] = tex;
+  glBindTexture(GL_TEXTURE_2D, tex);
+}
+
+// hand unit 0 back to the renderer
+static void reset_active_unit(void) {
+  if (gl_state_same(!unitActive, 1)) return;
+  glActiveTexture(GL_TEXTURE0);
+  unitActive = FALSE;
+}
+
+// Each cubeface is its own texture (rather than a cube map texture),
+// so that each can be sized for the part of the screen it covers.
+// (the shader selects the face itself, the same way textureCube would)
+// Each has its own framebuffer, which is only re-attached when its textures change.
+static GLuint faceFrameBuffers[6];
+static GLuint faceTextureColor[6];
+static u32 allocatedSize[6];
+static u8 faceFilter[6]; // filter mode that each color texture is set up for
+static u8 faceMipped[6]; // mipmaps were generated since the face was last rendered
+
+// Depth is only read back to reproject faces that are skipped (see the Cubeface schedule),
+// so faces rendered every frame share one depth renderbuffer (sized for the largest),
+// and only the others get a depth texture of their own.
+static GLuint faceTextureDepth[6];
+static u32 depthSize[6]; // size of each face's depth texture (0 if it has none)
+static GLuint sharedDepth;
+static u32 sharedDepthSize;
+
+// what is attached to each face's framebuffer
+// (depth is its texture, SHARED_DEPTH for the shared renderbuffer, or 0 before the first render)
+#define SHARED_DEPTH ((GLuint)-1)
+static GLuint attachedColor[6];
+static GLuint attachedDepth[6];
+
+// Storage is immutable where supported (ARB_texture_storage), so it is
+// allocated once per size with all of its mipmap levels.
+static u8 hasTexStorage;
+
+// store the cubeface colors in 16 bits (RGB5_A1, the precision of most of the game's textures),
+// halving their memory at the cost of banding in fog and shading, and of translucency over the sky
+static u8 lowBitFaces = FALSE;
+
+// coarsest mipmap level sampled by the projection
+// (a face only gets the levels whose texels fit in its gutter, see face_mip_levels)
+#define MAX_MIP_LEVEL 4
+static GLfloat maxAnisotropy = 1.0f; // queried from OpenGL
+
+#ifndef GL_TEXTURE_MAX_ANISOTROPY_EXT
+#define GL_TEXTURE_MAX_ANISOTROPY_EXT 0x84FE
+#define GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT 0x84FF
+#endif
+
+// texture units of the cubefaces in the projection shader
+// (units 0 and 1 are used by the renderer for its tiles)
+static const GLint faceUnits[6] = { 2, 3, 4, 5, 6, 7 };
+
+// texture units of the cubeface depths (for reprojecting skipped faces, see the Cubeface schedule)
+static const GLint faceDepthUnits[6] = { 10, 11, 12, 13, 14, 15 };
+
+static void set_tex_params(void) {
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+static u32 face_mip_levels(u32 size);
+
+// set the filtering of the bound cubeface color texture (of the given size) for the current filter mode
+static void set_face_filter(u32 size) {
+  GLint magFilter = filterMode == FLEXFOV_FILTER_SS9 ? GL_NEAREST : GL_LINEAR;
+  GLint minFilter = uses_mipmaps() ? GL_LINEAR_MIPMAP_LINEAR : magFilter;
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, magFilter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, face_mip_levels(size) - 1);
+  if (maxAnisotropy > 1.0f) {
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, filterMode == FLEXFOV_FILTER_ANISOTROPIC ? maxAnisotropy : 1.0f);
+  }
+}
+
+// (a texel of level l averages 2^l texels, which must not reach past the gutter,
+//  where the next face's texels would be clamped ones of this face)
+static u32 face_mip_levels(u32 size) {
+  u32 gutter = (u32)(size * (1.0f - FLEXFOV_FACE_SCALE) * 0.5f);
+  u32 levels = 1;
+  while (levels <= MAX_MIP_LEVEL && (size >> levels) > 0 && (1u << levels) <= gutter) levels++;
+  return levels;
+}
+
+// (immutable textures can't be re-specified, so they get a new name for each size)
+static void alloc_face_texture(GLint unit, GLuint *tex, u32 size, u32 levels, GLenum format, GLenum dataFormat, GLenum dataType) {
+  if (hasTexStorage) {
+    glDeleteTextures(1, tex);
+    glGenTextures(1, tex);
+    unitTextures[unit] = 0; // (the deleted texture was unbound, and the new name may be the same)
+    edit_unit(unit, *tex);
+    glTexStorage2D(GL_TEXTURE_2D, levels, format, size, size);
+  } else {
+    edit_unit(unit, *tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, size, size, 0, dataFormat, dataType, 0);
+  }
+  set_tex_params();
+  reset_active_unit();
+}
+
+static u8 cubemapResized; // a face was reallocated this frame (logged at the quad pass)
+
+static void resize_cubeside(u8 side) {
+  u32 size = renderSize[side];
+
+  // Allocate COLOR texture
+  // (with room for the mipmaps of any filter mode, since it can be changed at any time)
+  GLenum format = lowBitFaces ? GL_RGB5_A1 : GL_RGBA8;
+  alloc_face_texture(faceUnits[side], &faceTextureColor[side], size, face_mip_levels(size), format, GL_RGBA, GL_UNSIGNED_BYTE);
+  faceFilter[side] = FLEXFOV_FILTER_COUNT; // see set_face_filter
+  attachedColor[side] = 0; // (a new name may reuse the old one, which the framebuffer still holds)
+
+  allocatedSize[side] = size;
+  cubemapResized = TRUE;
+}
+
+// attach a depth buffer to the framebuffer of the cubeface being rendered
+// (attaching one replaces the other at the depth attachment)
+static void attach_depth(u8 side) {
+  u32 size = renderSize[side];
+  u8 keep = faceSchedule[side].interval > 1;
+  faceSchedule[side].keptDepth = keep;
+
+  if (keep) {
+    if (depthSize[side] != size) {
+      alloc_face_texture(faceDepthUnits[side], &faceTextureDepth[side], size, 1, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT);
+      depthSize[side] = size;
+      attachedDepth[side] = 0;
+      cubemapResized = TRUE;
+    }
+    if (!gl_state_same(attachedDepth[side] == faceTextureDepth[side], 1)) {
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, faceTextureDepth[side], 0);
+      attachedDepth[side] = faceTextureDepth[side];
+    }
+    return;
+  }
+
+  // (only grows, since the viewport just uses its corner)
+  if (sharedDepthSize < size) {
+    glBindRenderbuffer(GL_RENDERBUFFER, sharedDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    sharedDepthSize = size;
+    cubemapResized = TRUE;
+  }
+  if (!gl_state_same(attachedDepth[side] == SHARED_DEPTH, 1)) {
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sharedDepth);
+    attachedDepth[side] = SHARED_DEPTH;
+  }
+}
+
+// bytes of cubemap storage (color with its mipmaps, and depth)
+static u32 cubemap_bytes(void) {
+  u32 colorTexel = lowBitFaces ? 2 : 4;
+  u32 bytes = sharedDepthSize * sharedDepthSize * 4;
+  u8 i;
+  for (i=0; i<6; i++) {
+    u32 size = allocatedSize[i], levels = face_mip_levels(size), l;
+    for (l=0; l<levels; l++) bytes += (size >> l) * (size >> l) * colorTexel;
+    bytes += depthSize[i] * depthSize[i] * 4;
+  }
+  return bytes;
+}
+
+static void log_cubemap_memory(void) {
+  printf("cubemap: %.1f MB (shared depth %ux%u)\n", cubemap_bytes() / 1048576.0f, sharedDepthSize, sharedDepthSize);
+}
+
+static void create_cubemap(void) {
+  // OBJECTS
+  // Create frame buffer objects
+  // (the second draw buffer is unused)
+  GLenum attachments[2] = {GL_COLOR_ATTACHMENT0, GL_NONE};
+  glGenFramebuffers(6, faceFrameBuffers);
+  u8 i;
+  for (i=0; i<6; i++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, faceFrameBuffers[i]);
+    glDrawBuffers(2, attachments);
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  // Create cubeface texture objects
+  // (allocated when each face is first rendered, see init_cubeside)
+  glGenTextures(6, faceTextureColor);
+  glGenTextures(6, faceTextureDepth);
+  glGenRenderbuffers(1, &sharedDepth);
+  hasTexStorage = SDL_GL_ExtensionSupported("GL_ARB_texture_storage");
+
+  GLint maxSize;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+  maxFaceSize = maxSize;
+
+  // (left at 1 when EXT_texture_filter_anisotropic is missing)
+  glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+  glGetError();
+}
+
+static void restore_viewport(void) {
+  u32 w, h;
+  gfx_get_dimensions(&w, &h);
+
+  // opengl
+  glViewport(0,0,w,h);
+  glScissor(0,0,w,h);
+
+  // rdp
+  gfx_current_dimensions.width = w;
+  gfx_current_dimensions.height = h;
+  gfx_current_dimensions.aspect_ratio = (float)w / (float)h;
+}
+
+static void set_cubeside_viewport(u8 side) {
+  u32 size = renderSize[side];
+
+  glViewport(0,0,size,size);
+
+  // rdp
+  gfx_current_dimensions.width = size;
+  gfx_current_dimensions.height = size;
+  gfx_current_dimensions.aspect_ratio = 1.0f;
+}
+
+static u8 currSideGl;
+
+// scissor rect of the cubeface being rendered (limited to the part the projection uses)
+static u8 clipping;
+static s32 clipX0, clipY0, clipX1, clipY1;
+
+// keep a few texels around the used region for the supersampling taps
+// (or for the coarsest mipmap level, whose texels average 2^level texels)
+static const s32 clipMargin = 2;
+
+static void set_cubeside_clip(u8 side) {
+  s32 size = renderSize[side];
+  s32 margin = uses_mipmaps() ? clipMargin << MAX_MIP_LEVEL : clipMargin;
+
+  // skipped faces are reprojected as the camera turns, so keep room for that
+  if (faceSchedule[side].interval > 1) margin += (s32)(size * 0.5f * tanf(maxStaleAngle / 180.0f * 3.14159f));
+  struct FaceUsage *f = &faceUsage[side];
+  clipX0 = (s32)(f->s0 * size) - margin;
+  clipY0 = (s32)(f->t0 * size) - margin;
+  clipX1 = (s32)(f->s1 * size) + 1 + margin;
+  clipY1 = (s32)(f->t1 * size) + 1 + margin;
+  if (clipX0 < 0) clipX0 = 0;
+  if (clipY0 < 0) clipY0 = 0;
+  if (clipX1 > size) clipX1 = size;
+  if (clipY1 > size) clipY1 = size;
+  clipping = TRUE;
+}
+
+// called by the renderer whenever it sets its own scissor
+void flexfov_clip_scissor(int *x, int *y, int *width, int *height) {
+  if (!clipping) return;
+  s32 x0 = *x, y0 = *y, x1 = *x + *width, y1 = *y + *height;
+  if (x0 < clipX0) x0 = clipX0;
+  if (y0 < clipY0) y0 = clipY0;
+  if (x1 > clipX1) x1 = clipX1;
+  if (y1 > clipY1) y1 = clipY1;
+  *x = x0;
+  *y = y0;
+  *width = x1 > x0 ? x1 - x0 : 0;
+  *height = y1 > y0 ? y1 - y0 : 0;
+}
+
+static void init_cubeside(u8 side) {
+  currSideGl = side;
+  faceMipped[side] = FALSE;
+  if (allocatedSize[side] != renderSize[side]) resize_cubeside(side);
+  set_cubeside_viewport(side);
+  set_cubeside_clip(side);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, faceFrameBuffers[side]);
+  if (!gl_state_same(attachedColor[side] == faceTextureColor[side], 1)) {
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, faceTextureColor[side], 0);
+    attachedColor[side] = faceTextureColor[side];
+  }
+  attach_depth(side);
+
+  // only clear the part of the cubeface that we use
+  glScissor(clipX0, clipY0, clipX1 - clipX0, clipY1 - clipY0);
+  glEnable(GL_SCISSOR_TEST);
+  glDepthMask(GL_TRUE); // Must be set to clear Z-buffer
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // Objects rendered to FBO will not blend correctly with previous contents without this:
+  // https://stackoverflow.com/a/18497511/142317
+  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+void flexfov_set_light_direction(Light_t *light) {
+  // Light is always constant relative to the camera angle.
+  // So we have to force the same light direction for all cubefaces.
+
+  if (!flexfov_is_on()) return;
+
+  // replayed cubefaces all share the front modelview, so they are already consistent
+  if (replayFaces) return;
+
+  s8 x0=light->dir[0], y0=light->dir[1], z0=light->dir[2];
+  s8 x,y,z;
+
+  switch (currSideGl) {
+    case FLEXFOV_CUBE_FRONT: x =  x0; y =  y0; z =  z0; break;
+    case FLEXFOV_CUBE_LEFT:  x = -z0; y =  y0; z =  x0; break;
+    case FLEXFOV_CUBE_RIGHT: x =  z0; y =  y0; z = -x0; break;
+    case FLEXFOV_CUBE_BACK:  x = -x0; y =  y0; z = -z0; break;
+    case FLEXFOV_CUBE_UP:    x =  x0; y =  z0; z = -y0; break;
+    case FLEXFOV_CUBE_DOWN:  x =  x0; y = -z0; z =  y0; break;
+  }
+
+  light->dir[0] = x;
+  light->dir[1] = y;
+  light->dir[2] = z;
+}
+
+static float near, far;
+void flexfov_set_fog_planes(struct GraphNodePerspective *node) {
+  if (!flexfov_is_on()) return;
+  near = node->near;
+  far = node->far;
+}
+
+// Fog is scaled based on z-distance to the screen’s near plane.
+// For consistency across cubefaces, we scale it based on actual distance to the camera.
+// (computed for a whole load of vertices at once, then read back by each vertex)
+#define FOG_BATCH_SIZE 64 // (the size of the renderer's loaded vertices)
+static float fogZ[FOG_BATCH_SIZE], fogW[FOG_BATCH_SIZE];
+
+void flexfov_set_fog_batch(float m[4][4], const Vtx *vertices, u32 n) {
+  if (!flexfov_is_on()) return;
+  if (n > FOG_BATCH_SIZE) n = FOG_BATCH_SIZE;
+
+  struct FlexFovFogPlanes planes;
+  flexfov_fog_planes(near, far, &planes);
+  flexfov_fog_depths(m, vertices[0].v.ob, sizeof(Vtx) / sizeof(s16), n, &planes, fogZ, fogW);
+}
+
+void flexfov_set_fog_scale(u32 i, float *z, float *w) {
+  if (!flexfov_is_on() || i >= FOG_BATCH_SIZE) return;
+  *z = fogZ[i];
+  *w = fogW[i];
+}
+
+//------------------------------------------------------------------------------
+// Sky panorama (the skybox rendered once per area, then looked up by ray)
+//------------------------------------------------------------------------------
+
+// The skybox is a 360° strip of tiles that the game scrolls by camera yaw and pitch,
+// so only camera rotation changes it. Rather than drawing it behind the projection
+// each frame, we draw the whole strip into a texture when the area's background
+// changes, and the projection looks up each ray in it (see skycolor in flexfov.frag).
+#define SKY_SIZE 1024
+static GLuint skyFrameBuffer;
+static GLuint skyTexture;
+static const GLint skyUnit = 9;
+static u8 skyQueued; // the sky pass was added to this frame's display list
+
+static void create_sky(void) {
+  glGenTextures(1, &skyTexture);
+  edit_unit(skyUnit, skyTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SKY_SIZE, SKY_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT); // wraps around in yaw
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  reset_active_unit();
+
+  glGenFramebuffers(1, &skyFrameBuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, skyFrameBuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, skyTexture, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+static void init_sky(void) {
+  clipping = FALSE;
+  glBindFramebuffer(GL_FRAMEBUFFER, skyFrameBuffer);
+
+  glViewport(0,0,SKY_SIZE,SKY_SIZE);
+
+  // rdp (the strip is laid out in the game's 4:3 screen units, see skybox.c in patch.diff)
+  gfx_current_dimensions.width = SKY_SIZE;
+  gfx_current_dimensions.height = SKY_SIZE;
+  gfx_current_dimensions.aspect_ratio = 4.0f / 3.0f;
+
+  glDisable(GL_SCISSOR_TEST);
+  glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glEnable(GL_SCISSOR_TEST);
+}
+
+//------------------------------------------------------------------------------
+// Profiler (time and size of each stage, marked by flexfov_run_marker)
+//------------------------------------------------------------------------------
+
+enum PROFILE_STAGE {
+  PROFILE_SKY,
+  PROFILE_FACE, // one stage for each cubeface (see FLEXFOV_CUBE_SIDE)
+  PROFILE_QUAD = PROFILE_FACE + 6,
+  PROFILE_STAGES
+};
+static const char *profileStageNames[PROFILE_STAGES] = { "sky", "front", "left", "right", "back", "up", "down", "quad" };
+
+// each stage starts at a mark, and the last one ends at PROFILE_END
+#define PROFILE_END PROFILE_STAGES
+#define PROFILE_MARKS (PROFILE_STAGES+1)
+
+// GL timestamps are read back this many frames later, so we never wait on them
+#define PROFILE_FRAMES 4
+
+struct ProfileFrame {
+  u32 frame;
+  u16 marked; // bitmask of the marks made this frame (unused faces have none)
+  GLuint queries[PROFILE_MARKS];
+  Uint64 cpuMarks[PROFILE_MARKS];
+  u32 vertices[PROFILE_STAGES];
+  u32 triangles[PROFILE_STAGES];
+  u32 flushes[PROFILE_STAGES];
+  u32 glCalls[PROFILE_STAGES];   // made at our shadowed call sites (see gl_state_same), not the renderer's
+  u32 glSkipped[PROFILE_STAGES]; // skipped there by the shadows
+  u32 xformHits[PROFILE_STAGES];   // transforms reused from the transform cache when the stage was built (without replayFaces)
+  u32 xformMisses[PROFILE_STAGES]; // and computed
+  u32 culled[PROFILE_STAGES]; // objects culled from the stage when it was built (without replayFaces)
+  u32 culledFar; // objects culled by the far limit from the replayed world pass (with replayFaces)
+  u32 ages[6]; // frames since each cubeface was rendered (see FaceSchedule)
+};
+static struct ProfileFrame profileFrames[PROFILE_FRAMES];
+static struct ProfileFrame *profileCurr;
+static u32 profileFrame;
+static s8 profileStage = -1; // stage being rendered (-1 outside of them)
+
+// smoothed ms of each stage (shown by the overlay)
+static float profileCpu[PROFILE_STAGES];
+static float profileGpu[PROFILE_STAGES];
+static const float profileBudget = 1000.0f / 30.0f;
+static float frameWaitMs; // waited on the GPU at the end of each frame (see Frame pacing)
+
+static FILE *profileCsv;
+
+static void create_profiler(void) {
+  u8 i;
+  for (i=0; i<PROFILE_FRAMES; i++) glGenQueries(PROFILE_MARKS, profileFrames[i].queries);
+}
+
+// time from each mark to the next one made in the same frame
+static void profile_durations(struct ProfileFrame *f, const double marks[PROFILE_MARKS], float ms[PROFILE_STAGES]) {
+  u8 i, j;
+  for (i=0; i<PROFILE_STAGES; i++) {
+    ms[i] = 0.0f;
+    if (!(f->marked & (1 << i))) continue;
+    for (j=i+1; j<PROFILE_MARKS; j++) {
+      if (f->marked & (1 << j)) {
+        ms[i] = (float)(marks[j] - marks[i]);
+        break;
+      }
+    }
+  }
+}
+
+static void profile_smooth(float *avg, float ms) {
+  *avg = *avg == 0.0f ? ms : *avg + (ms - *avg) * 0.1f;
+}
+
+// read back a finished frame (dropping it if the GPU isn't done with it yet)
+static void profile_collect(struct ProfileFrame *f) {
+  if (!(f->marked & (1 << PROFILE_END))) return;
+
+  GLuint available = 0;
+  glGetQueryObjectuiv(f->queries[PROFILE_END], GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available) return;
+
+  double cpuMarks[PROFILE_MARKS], gpuMarks[PROFILE_MARKS];
+  double freq = SDL_GetPerformanceFrequency();
+  u8 i;
+  for (i=0; i<PROFILE_MARKS; i++) {
+    if (!(f->marked & (1 << i))) continue;
+    GLuint64 ns;
+    glGetQueryObjectui64v(f->queries[i], GL_QUERY_RESULT, &ns);
+    gpuMarks[i] = ns / 1000000.0;
+    cpuMarks[i] = f->cpuMarks[i] * 1000.0 / freq;
+  }
+
+  float cpu[PROFILE_STAGES], gpu[PROFILE_STAGES];
+  profile_durations(f, cpuMarks, cpu);
+  profile_durations(f, gpuMarks, gpu);
+  float cpuTotal = 0.0f, gpuTotal = 0.0f;
+  for (i=0; i<PROFILE_STAGES; i++) {
+    profile_smooth(&profileCpu[i], cpu[i]);
+    profile_smooth(&profileGpu[i], gpu[i]);
+    cpuTotal += cpu[i];
+    gpuTotal += gpu[i];
+  }
+  update_resolution_scale(cpuTotal, gpuTotal);
+  if (!profileOn) return;
+
+  if (!profileCsv) {
+    profileCsv = fopen("flexfov_profile.csv", "w");
+    if (!profileCsv) return;
+    fprintf(profileCsv, "frame");
+    for (i=0; i<PROFILE_STAGES; i++) {
+      const char *n = profileStageNames[i];
+      fprintf(profileCsv, ",%s_cpu_ms,%s_gpu_ms,%s_vertices,%s_triangles,%s_flushes,%s_gl_calls,%s_gl_skipped,%s_xform_hits,%s_xform_misses,%s_culled", n, n, n, n, n, n, n, n, n, n);
+    }
+    for (i=0; i<6; i++) fprintf(profileCsv, ",%s_age", profileStageNames[PROFILE_FACE + i]);
+    fprintf(profileCsv, ",culled_far,resolution_scale\n");
+  }
+  fprintf(profileCsv, "%u", f->frame);
+  for (i=0; i<PROFILE_STAGES; i++) {
+    fprintf(profileCsv, ",%.3f,%.3f,%u,%u,%u,%u,%u,%u,%u,%u", cpu[i], gpu[i], f->vertices[i], f->triangles[i], f->flushes[i],
+      f->glCalls[i], f->glSkipped[i], f->xformHits[i], f->xformMisses[i], f->culled[i]);
+  }
+  for (i=0; i<6; i++) fprintf(profileCsv, ",%u", f->ages[i]);
+  fprintf(profileCsv, ",%u,%.2f\n", f->culledFar, resolutionScale);
+}
+
+static void profile_mark(u8 mark) {
+  if (!profileCurr) return;
+  profileCurr->marked |= 1 << mark;
+  profileCurr->cpuMarks[mark] = SDL_GetPerformanceCounter();
+  glQueryCounter(profileCurr->queries[mark], GL_TIMESTAMP);
+  profileStage = mark < PROFILE_STAGES ? mark : -1;
+}
+
+// start a frame at the sky pass, reusing the oldest slot of the ring
+static void profile_begin_frame(void) {
+  // (the dynamic resolution reads the frame times too)
+  if (!profileOn && !resolutionOn) {
+    profileCurr = NULL;
+    profileStage = -1;
+    return;
+  }
+  struct ProfileFrame *f = &profileFrames[profileFrame % PROFILE_FRAMES];
+  profile_collect(f);
+  memset(f->vertices, 0, sizeof(f->vertices));
+  memset(f->triangles, 0, sizeof(f->triangles));
+  memset(f->flushes, 0, sizeof(f->flushes));
+  memset(f->glCalls, 0, sizeof(f->glCalls));
+  memset(f->glSkipped, 0, sizeof(f->glSkipped));
+  memset(f->xformHits, 0, sizeof(f->xformHits));
+  memset(f->xformMisses, 0, sizeof(f->xformMisses));
+  memset(f->culled, 0, sizeof(f->culled));
+  u8 i;
+  for (i=0; i<6; i++) f->ages[i] = faceSchedule[i].age;
+  // (the display list being run was built just before, with these counts)
+  memcpy(&f->xformHits[PROFILE_FACE], xformHits, sizeof(xformHits));
+  memcpy(&f->xformMisses[PROFILE_FACE], xformMisses, sizeof(xformMisses));
+  memcpy(&f->culled[PROFILE_FACE], culledObjects, sizeof(culledObjects));
+  f->culledFar = culledFar;
+  f->marked = 0;
+  f->frame = profileFrame++;
+  profileCurr = f;
+  profile_mark(PROFILE_SKY);
+}
+
+static void profile_end_frame(void) {
+  profile_mark(PROFILE_END);
+  profileCurr = NULL;
+}
+
+// called by the renderer (see patch.diff)
+void flexfov_count_vertices(u32 n) {
+  if (profileStage >= 0) profileCurr->vertices[profileStage] += n;
+}
+
+void flexfov_count_flush(u32 triangles) {
+  if (profileStage < 0) return;
+  profileCurr->triangles[profileStage] += triangles;
+  profileCurr->flushes[profileStage]++;
+}
+
+static void count_gl_state(u8 skipped, u32 calls) {
+  if (profileStage < 0) return;
+  if (skipped) profileCurr->glSkipped[profileStage] += calls;
+  else profileCurr->glCalls[profileStage] += calls;
+}
+
+void log_profile(void) {
+  // (GL state calls of the latest frame, made and skipped by the shadows,
+  //  transforms reused from the transform cache and computed, and objects culled)
+  struct ProfileFrame *f = &profileFrames[(profileFrame + PROFILE_FRAMES - 1) % PROFILE_FRAMES];
+  u8 i;
+  for (i=0; i<PROFILE_STAGES; i++) {
+    printf("%-5s cpu=%.2fms gpu=%.2fms gl=%u skipped=%u xform hits=%u misses=%u culled=%u\n", profileStageNames[i], profileCpu[i], profileGpu[i],
+      f->glCalls[i], f->glSkipped[i], f->xformHits[i], f->xformMisses[i], f->culled[i]);
+  }
+  if (replayFaces) printf("culled by the far limit: %u\n", f->culledFar);
+  if (!glShadows) printf("(GL state shadows off, FLEXFOV_GL_SHADOW=0)\n");
+  printf("wait  cpu=%.2fms (for the GPU to catch up, see Frame pacing)\n", frameWaitMs);
+}
+
+//------------------------------------------------------------------------------
+// projection setup and rendering
+//------------------------------------------------------------------------------
+
+// The overlays and the filter mode are compiled into separate programs,
+// so that the usual one (no overlays) has no branches for them (see Toggles in flexfov.frag).
+enum QUAD_VARIANT_BITS {
+  QUAD_RUBIX    = 1 << 0,
+  QUAD_CONTROLS = 1 << 1,
+  QUAD_PROFILE  = 1 << 2,
+  QUAD_OVERLAYS = 1 << 3  // (number of overlay combinations)
+};
+#define QUAD_VARIANTS (QUAD_OVERLAYS * FLEXFOV_FILTER_COUNT)
+
+// values last uploaded to a program's uniforms, so unchanged ones aren't uploaded again
+// (zero, like the uniforms of a newly linked program)
+struct QuadUniforms {
+  GLfloat fov;
+  GLfloat mobiusZoom;
+  GLint zooming;
+  GLfloat screenSize[2];
+  GLfloat faceSizes[6];
+  GLfloat faceAges[6];
+  GLfloat faceRotations[6*9];
+  GLfloat faceOrigins[6*3];
+  GLfloat faceFars[6];
+  GLfloat skyBasis[9];
+  GLfloat viewRotation[9];
+  GLfloat profileCpu[PROFILE_STAGES];
+  GLfloat profileGpu[PROFILE_STAGES];
+};
+
+struct QuadProgram {
+  GLuint prog;
+  struct QuadUniforms last;
+  GLint fov;
+  GLint mobiusZoom;
+  GLint zooming;
+  GLint faceTextures;
+  GLint rayTexture;
+  GLint screenSize;
+  GLint faceSizes;
+  GLint faceDepths;
+  GLint faceAges;
+  GLint faceRotations;
+  GLint faceOrigins;
+  GLint faceFars;
+  GLint skyTexture;
+  GLint skyBasis;
+  GLint viewRotation;
+  GLint profileCpu;
+  GLint profileGpu;
+  GLint profileBudget;
+};
+static struct QuadProgram quadProgs[QUAD_VARIANTS];
+static struct QuadProgram *quad; // the variant drawing this frame
+
+// the ray pass (same shader with RAY_PASS defined, see flexfov.frag)
+// (one program per projection, see PROJECTION in flexfov.frag)
+enum RAY_VARIANT { RAY_CUBENET, RAY_MERCATOR, RAY_EQUIRECT, RAY_VARIANTS };
+
+struct RayProgram {
+  GLuint prog;
+  GLint camPitch;
+  GLint fov;
+  GLint mobiusZoom;
+};
+static struct RayProgram rayProgs[RAY_VARIANTS];
+
+// the HUD pass of fast view (see OVERLAY_PASS in flexfov.frag)
+static GLuint overlayProg;
+static GLint overlayScreenSize;
+static const GLint overlayUnit = 16;
+
+// turns the rays of the quad pass by the camera turn predicted since the last tick (see Fast view)
+static const GLfloat identityRotation[9] = { 1,0,0, 0,1,0, 0,0,1 };
+static GLfloat viewRotation[9] = { 1,0,0, 0,1,0, 0,0,1 };
+
+// Ray of each screen pixel (xyz, w = 1 or all zero if blank), see RAY_PASS in flexfov.frag.
+static GLuint rayFrameBuffer;
+static GLuint rayTexture;
+static const GLint rayUnit = 8;
+
+// Z depths:
+//  * sky = -0.33
+//  * hud = -1
+//  * pause = 0
+
+static GLfloat quadVerts[] = {
+// x      y     u     v
+// (clip space) (aspect-normalized texture space)
+  -1.0f, -1.0f, 0.0f, 0.0f, // bottom left
+   1.0f, -1.0f, 0.0f, 0.0f, // bottom right
+  -1.0f,  1.0f, 0.0f, 0.0f, // top left
+
+  -1.0f,  1.0f, 0.0f, 0.0f, // top left
+   1.0f,  1.0f, 0.0f, 0.0f, // top right
+   1.0f, -1.0f, 0.0f, 0.0f  // bottom right
+};
+static const u8 numQuadVerts = 6;
+static const u8 quadStride = 4;
+
+// attribute locations, bound before linking so that every program shares the quad's vertex array
+#define QUAD_ATTR_XY 0
+#define QUAD_ATTR_UV 1
+
+// the quad's vertices (only uploaded when the window is resized, see update_aspect)
+static GLuint quadVao;
+static GLuint quadVbo;
+static u32 quadWidth, quadHeight;
+
+static const char *quadFragSrc=
+#include "flexfov.frag"
+;
+
+static const char *quadVertSrc =
+"#version 110\n"
+"\n"
+"attribute vec2 aXY;\n"
+"attribute vec2 aUV;\n"
+"varying vec2 vUV;\n"
+"\n"
+"void main(void)\n"
+"{\n"
+"  vUV = aUV;\n"
+"  gl_Position = vec4(aXY, 1.0, 1.0);\n"
+"}\n"
+;
+
+// Program binary cache
+// Linked programs are saved with glGetProgramBinary and loaded on the next
+// launch instead of compiling them again. The file is only used by the same
+// driver (vendor, renderer and GL version), and each program is keyed by its
+// source and defines, so any mismatch just falls back to compiling.
+//   FLEXFOV_SHADER_CACHE=file  where to keep it (default flexfov_shaders.bin, "" to turn off)
+
+#define SHADER_CACHE_MAGIC 0x43534646 // "FFSC"
+#define SHADER_CACHE_VERSION 2
+#define SHADER_CACHE_MAX 64
+
+struct CachedProgram {
+  u64 key;
+  GLenum format;
+  GLint length;
+  void *binary;
+};
+
+static const char *shaderCachePath;
+static u64 shaderCacheDriver;
+static struct CachedProgram shaderCache[SHADER_CACHE_MAX];
+static u8 shaderCacheCount;
+static u8 shaderCacheDirty;
+static u8 shaderCacheLoads, shaderCacheCompiles;
+
+// FNV-1a
+static u64 hash_string(u64 h, const char *str) {
+  for (; *str; str++) {
+    h ^= (u8)*str;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static u64 shader_cache_key(const char *defines) {
+  u64 h = hash_string(0xcbf29ce484222325ULL, quadVertSrc);
+  h = hash_string(h, quadFragSrc);
+  return hash_string(h, defines);
+}
+
+#ifdef USE_GLES
+
+// (no program binaries in GLES 2)
+static void shader_cache_open(void) {}
+static GLuint load_cached_program(u64 key) { return 0; }
+static void prepare_cached_program(GLuint prog) {}
+static void store_cached_program(u64 key, GLuint prog) { shaderCacheCompiles++; }
+static void shader_cache_save(void) {}
+
+#else
+
+static void shader_cache_open(void) {
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  const char *path = getenv("FLEXFOV_SHADER_CACHE");
+  if (!path) path = "flexfov_shaders.bin";
+  if (formats == 0 || path[0] == '\0') return;
+  shaderCachePath = path;
+
+  u64 h = hash_string(0xcbf29ce484222325ULL, (const char *)glGetString(GL_VENDOR));
+  h = hash_string(h, (const char *)glGetString(GL_RENDERER));
+  shaderCacheDriver = hash_string(h, (const char *)glGetString(GL_VERSION));
+
+  FILE *f = fopen(path, "rb");
+  if (!f) return;
+  u32 header[2];
+  u64 driver;
+  u8 count;
+  if (fread(header, sizeof(header), 1, f) == 1 && header[0] == SHADER_CACHE_MAGIC && header[1] == SHADER_CACHE_VERSION &&
+      fread(&driver, sizeof(driver), 1, f) == 1 && driver == shaderCacheDriver &&
+      fread(&count, sizeof(count), 1, f) == 1) {
+    while (shaderCacheCount < count && shaderCacheCount < SHADER_CACHE_MAX) {
+      struct CachedProgram *c = &shaderCache[shaderCacheCount];
+      if (fread(&c->key, sizeof(c->key), 1, f) != 1 ||
+          fread(&c->format, sizeof(c->format), 1, f) != 1 ||
+          fread(&c->length, sizeof(c->length), 1, f) != 1 || c->length <= 0) break;
+      c->binary = malloc(c->length);
+      if (fread(c->binary, c->length, 1, f) != 1) {
+        free(c->binary);
+        break;
+      }
+      shaderCacheCount++;
+    }
+  }
+  fclose(f);
+}
+
+static struct CachedProgram *find_cached_program(u64 key) {
+  u8 i;
+  for (i=0; i<shaderCacheCount; i++) {
+    if (shaderCache[i].key == key) return &shaderCache[i];
+  }
+  return NULL;
+}
+
+// returns 0 if the program isn't cached (or the driver rejects its binary)
+static GLuint load_cached_program(u64 key) {
+  struct CachedProgram *c = find_cached_program(key);
+  if (!c || !c->binary) return 0;
+
+  GLuint prog = glCreateProgram();
+  glProgramBinary(prog, c->format, c->binary, c->length);
+  GLint success;
+  glGetProgramiv(prog, GL_LINK_STATUS, &success);
+  if (!success) {
+    glDeleteProgram(prog);
+    free(c->binary);
+    c->binary = NULL;
+    return 0;
+  }
+  shaderCacheLoads++;
+  return prog;
+}
+
+static void prepare_cached_program(GLuint prog) {
+  if (shaderCachePath) glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+static void store_cached_program(u64 key, GLuint prog) {
+  shaderCacheCompiles++;
+  if (!shaderCachePath) return;
+  struct CachedProgram *c = find_cached_program(key);
+  if (!c) {
+    if (shaderCacheCount == SHADER_CACHE_MAX) return;
+    c = &shaderCache[shaderCacheCount++];
+    c->key = key;
+  }
+  free(c->binary);
+  c->binary = NULL;
+  glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &c->length);
+  if (c->length <= 0) return;
+  c->binary = malloc(c->length);
+  glGetProgramBinary(prog, c->length, NULL, &c->format, c->binary);
+  shaderCacheDirty = TRUE;
+}
+
+static void shader_cache_save(void) {
+  if (!shaderCacheDirty) return;
+  shaderCacheDirty = FALSE;
+  FILE *f = fopen(shaderCachePath, "wb");
+  if (!f) {
+    printf("flexfov: can't write shader cache %s\n", shaderCachePath);
+    return;
+  }
+  u32 header[2] = { SHADER_CACHE_MAGIC, SHADER_CACHE_VERSION };
+  u8 count = 0, i;
+  for (i=0; i<shaderCacheCount; i++) {
+    if (shaderCache[i].binary) count++;
+  }
+  fwrite(header, sizeof(header), 1, f);
+  fwrite(&shaderCacheDriver, sizeof(shaderCacheDriver), 1, f);
+  fwrite(&count, sizeof(count), 1, f);
+  for (i=0; i<shaderCacheCount; i++) {
+    struct CachedProgram *c = &shaderCache[i];
+    if (!c->binary) continue;
+    fwrite(&c->key, sizeof(c->key), 1, f);
+    fwrite(&c->format, sizeof(c->format), 1, f);
+    fwrite(&c->length, sizeof(c->length), 1, f);
+    fwrite(c->binary, c->length, 1, f);
+  }
+  fclose(f);
+}
+
+#endif
+
+static GLuint compile_shader(GLenum type, const char *name, const char *defines, const char *src) {
+  GLint success;
+
+  // defines have to go after the #version line
+  const char *version = "#version 110\n";
+  const char *body = strchr(src, '\n') + 1;
+  const char *srcs[3] = { version, defines, body };
+
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 3, srcs, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+  if (!success) {
+      GLint max_length = 0;
+      glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &max_length);
+      char error_log[1024];
+      printf("%s shader compilation failed\n", name);
+      glGetShaderInfoLog(shader, sizeof(error_log), &max_length, &error_log[0]);
+      printf("%s\n", &error_log[0]);
+      abort();
+  }
+  return shader;
+}
+
+static GLuint create_program(const char *name, const char *defines) {
+  u64 key = shader_cache_key(defines);
+  GLuint prog = load_cached_program(key);
+  if (prog) return prog;
+
+  GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, name, "", quadVertSrc);
+  GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, name, defines, quadFragSrc);
+
+  prog = glCreateProgram();
+  prepare_cached_program(prog);
+  glAttachShader(prog, vertex_shader);
+  glAttachShader(prog, fragment_shader);
+  glBindAttribLocation(prog, QUAD_ATTR_XY, "aXY");
+  glBindAttribLocation(prog, QUAD_ATTR_UV, "aUV");
+  glLinkProgram(prog);
+  glDeleteShader(vertex_shader);
+  glDeleteShader(fragment_shader);
+
+  // (waiting on the link here also keeps drivers from finishing it on first use, mid-game)
+  GLint success;
+  glGetProgramiv(prog, GL_LINK_STATUS, &success);
+  if (!success) {
+      char error_log[1024];
+      printf("%s program link failed\n", name);
+      glGetProgramInfoLog(prog, sizeof(error_log), NULL, &error_log[0]);
+      printf("%s\n", &error_log[0]);
+      abort();
+  }
+  store_cached_program(key, prog);
+  return prog;
+}
+
+static void create_quad_variant(u8 variant) {
+  u8 overlays = variant % QUAD_OVERLAYS;
+  char defines[256];
+  snprintf(defines, sizeof(defines), "%s%s%s#define FILTER_MODE %d\n",
+    overlays & QUAD_RUBIX ? "#define USE_RUBIX\n" : "",
+    overlays & QUAD_CONTROLS ? "#define CONTROLS_ON\n" : "",
+    overlays & QUAD_PROFILE ? "#define SHOW_PROFILE\n" : "",
+    variant / QUAD_OVERLAYS);
+
+  struct QuadProgram *q = &quadProgs[variant];
+  GLuint prog = q->prog = create_program("Quad", defines);
+
+  // Uniforms
+  q->fov = glGetUniformLocation(prog, "fov");
+  q->mobiusZoom = glGetUniformLocation(prog, "mobiusZoom");
+  q->zooming = glGetUniformLocation(prog, "zooming");
+  q->faceTextures = glGetUniformLocation(prog, "faceTextures");
+  q->rayTexture = glGetUniformLocation(prog, "rayTexture");
+  q->screenSize = glGetUniformLocation(prog, "screenSize");
+  q->faceSizes = glGetUniformLocation(prog, "faceSizes");
+  q->faceDepths = glGetUniformLocation(prog, "faceDepths");
+  q->faceAges = glGetUniformLocation(prog, "faceAges");
+  q->faceRotations = glGetUniformLocation(prog, "faceRotations");
+  q->faceOrigins = glGetUniformLocation(prog, "faceOrigins");
+  q->faceFars = glGetUniformLocation(prog, "faceFars");
+  q->skyTexture = glGetUniformLocation(prog, "skyTexture");
+  q->skyBasis = glGetUniformLocation(prog, "skyBasis");
+  q->viewRotation = glGetUniformLocation(prog, "viewRotation");
+  q->profileCpu = glGetUniformLocation(prog, "profileCpu");
+  q->profileGpu = glGetUniformLocation(prog, "profileGpu");
+  q->profileBudget = glGetUniformLocation(prog, "profileBudget");
+
+  // (texture units and the budget never change, so they're only set here)
+  glUseProgram(prog);
+  glUniform1iv(q->faceTextures, 6, faceUnits);
+  glUniform1iv(q->faceDepths, 6, faceDepthUnits);
+  glUniform1i(q->rayTexture, rayUnit);
+  glUniform1i(q->skyTexture, skyUnit);
+  glUniform1f(q->profileBudget, profileBudget);
+  glUniformMatrix3fv(q->viewRotation, 1, GL_FALSE, identityRotation);
+  memcpy(q->last.viewRotation, identityRotation, sizeof(identityRotation));
+  glUseProgram(0);
+}
+
+static void create_ray_variant(u8 variant) {
+  char defines[64];
+  snprintf(defines, sizeof(defines), "#define RAY_PASS\n#define PROJECTION %d\n", variant);
+
+  struct RayProgram *r = &rayProgs[variant];
+  GLuint prog = r->prog = create_program("Ray", defines);
+  r->camPitch = glGetUniformLocation(prog, "camPitch");
+  r->fov = glGetUniformLocation(prog, "fov");
+  r->mobiusZoom = glGetUniformLocation(prog, "mobiusZoom");
+}
+
+static void create_overlay_program(void) {
+  overlayProg = create_program("Overlay", "#define OVERLAY_PASS\n");
+  overlayScreenSize = glGetUniformLocation(overlayProg, "screenSize");
+  glUseProgram(overlayProg);
+  glUniform1i(glGetUniformLocation(overlayProg, "overlayTexture"), overlayUnit);
+  glUseProgram(0);
+}
+
+static struct QuadProgram *quad_variant(void) {
+  u8 overlays = 0;
+  if (useRubix) overlays |= QUAD_RUBIX;
+  if (controlsOn) overlays |= QUAD_CONTROLS;
+  if (profileOn) overlays |= QUAD_PROFILE;
+  return &quadProgs[filterMode * QUAD_OVERLAYS + overlays];
+}
+
+static struct RayProgram *ray_variant(const struct FlexFovKnobs *knobs) {
+  if (knobs->useCube) return &rayProgs[RAY_CUBENET];
+  return &rayProgs[knobs->fov < 360.0f ? RAY_MERCATOR : RAY_EQUIRECT];
+}
+
+static void create_quad(void) {
+
+  // CREATE SHADER PROGRAMS
+  // (all variants up front, so toggling an overlay never stalls on a compile)
+
+  Uint64 start = SDL_GetPerformanceCounter();
+  shader_cache_open();
+  u8 i;
+  for (i=0; i<QUAD_VARIANTS; i++) create_quad_variant(i);
+  for (i=0; i<RAY_VARIANTS; i++) create_ray_variant(i);
+  create_overlay_program();
+  shader_cache_save();
+  printf("flexfov: %u shader programs in %.1fms (%u from cache, %u compiled)\n",
+    QUAD_VARIANTS + RAY_VARIANTS + 1, (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency(),
+    shaderCacheLoads, shaderCacheCompiles);
+
+  // RAY TEXTURE
+  // (allocated when the window size is known, see update_rays)
+  glGenFramebuffers(1, &rayFrameBuffer);
+  glGenTextures(1, &rayTexture);
+
+  // QUAD VERTICES
+  // (filled when the window size is known, see update_aspect)
+  glGenBuffers(1, &quadVbo);
+#ifndef USE_GLES
+  GLint rendererVbo;
+  glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &rendererVbo);
+  glGenVertexArrays(1, &quadVao);
+  glBindVertexArray(quadVao);
+  glBindBuffer(GL_ARRAY_BUFFER, quadVbo);
+  glEnableVertexAttribArray(QUAD_ATTR_XY);
+  glVertexAttribPointer(QUAD_ATTR_XY, 2, GL_FLOAT, GL_FALSE, quadStride*sizeof(float), NULL);
+  glEnableVertexAttribArray(QUAD_ATTR_UV);
+  glVertexAttribPointer(QUAD_ATTR_UV, 2, GL_FLOAT, GL_FALSE, quadStride*sizeof(float), (void*)(2*sizeof(float)));
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, rendererVbo);
+#endif
+}
+
+// set aspect-normalized uv
+static void update_aspect(u32 w, u32 h) {
+  if (w == quadWidth && h == quadHeight) return;
+  quadWidth = w;
+  quadHeight = h;
+
+  float u,v;
+  flexfov_aspect_uv(w, h, &u, &v);
+
+  // update quadVerts with aspect-normalized uv
+  u8 i;
+  for (i=0; i<numQuadVerts; i++) {
+    u8 j = i*quadStride;
+    quadVerts[j+2] = quadVerts[j]*u;
+    quadVerts[j+3] = quadVerts[j+1]*v;
+  }
+
+  // (keeping the renderer's buffer bound for its next flush)
+  GLint rendererVbo;
+  glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &rendererVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, quadVbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quadVerts), quadVerts, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, rendererVbo);
+}
+
+// what the rays were computed for (recomputed when these change)
+static struct FlexFovKnobs rayKnobs;
+static u32 rayWidth, rayHeight;
+
+#ifdef USE_GLES
+// (no vertex array objects in GLES 2, so the attributes are pointed at the quad each draw)
+static void draw_quad_verts(void) {
+  GLint rendererVbo;
+  glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &rendererVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, quadVbo);
+  glEnableVertexAttribArray(QUAD_ATTR_XY); glVertexAttribPointer(QUAD_ATTR_XY, 2, GL_FLOAT, GL_FALSE, quadStride*sizeof(float), NULL);
+  glEnableVertexAttribArray(QUAD_ATTR_UV); glVertexAttribPointer(QUAD_ATTR_UV, 2, GL_FLOAT, GL_FALSE, quadStride*sizeof(float), (void*)(2*sizeof(float)));
+    glDrawArrays(GL_TRIANGLES, 0, numQuadVerts);
+  glDisableVertexAttribArray(QUAD_ATTR_XY);
+  glDisableVertexAttribArray(QUAD_ATTR_UV);
+  glBindBuffer(GL_ARRAY_BUFFER, rendererVbo);
+}
+#else
+static void draw_quad_verts(void) {
+  glBindVertexArray(quadVao);
+  glDrawArrays(GL_TRIANGLES, 0, numQuadVerts);
+  glBindVertexArray(0);
+}
+#endif
+
+// copy a uniform's value into its shadow, returning TRUE if it changed
+static u8 uniform_changed(void *last, const void *value, size_t size) {
+  if (gl_state_same(memcmp(last, value, size) == 0, 1)) return FALSE;
+  memcpy(last, value, size);
+  return TRUE;
+}
+#define UNIFORM_CHANGED(name, value) uniform_changed(&quad->last.name, value, sizeof(quad->last.name))
+
+static void update_rays(u32 w, u32 h) {
+  struct FlexFovKnobs knobs = { fov, camPitch, getMobiusZoom(), useCube };
+
+  // pitch only bends the rays through the flex projection used for mobius zoom
+  if (knobs.useCube || knobs.mobiusZoom == 0.0f) knobs.camPitch = 0.0f;
+
+  u8 resized = w != rayWidth || h != rayHeight;
+  if (!resized && memcmp(&knobs, &rayKnobs, sizeof(knobs)) == 0) {
+    return;
+  }
+  rayKnobs = knobs;
+
+  if (resized) {
+    edit_unit(rayUnit, rayTexture);
+    // (needs full float precision to address texels of the largest cubefaces)
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindFramebuffer(GL_FRAMEBUFFER, rayFrameBuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, rayTexture, 0);
+    rayWidth = w;
+    rayHeight = h;
+    reset_active_unit();
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, rayFrameBuffer);
+  glDisable(GL_BLEND);
+
+  struct RayProgram *ray = ray_variant(&knobs);
+  glUseProgram(ray->prog);
+  glUniform1f(ray->camPitch, knobs.camPitch);
+  glUniform1f(ray->fov, knobs.fov);
+  glUniform1f(ray->mobiusZoom, knobs.mobiusZoom);
+  draw_quad_verts();
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// GPU time of the quad pass (including mipmap generation) for each filter mode,
+// so that the cheapest acceptable mode can be picked per machine.
+static GLuint filterQuery;
+static u8 filterQueryPending;
+static u8 filterQueryMode;
+static u8 viewFrame; // an extra frame of the fast view is being drawn (not timed)
+static float filterCost[FLEXFOV_FILTER_COUNT]; // ms (smoothed)
+static u8 loggedFilterMode = FLEXFOV_FILTER_COUNT;
+
+static const char *filterNames[FLEXFOV_FILTER_COUNT] = { "ss9", "trilinear", "anisotropic", "adaptive" };
+
+void log_filter_cost(void) {
+  u8 i;
+  printf("filter: %s (", filterNames[filterMode]);
+  for (i=0; i<FLEXFOV_FILTER_COUNT; i++) {
+    if (filterCost[i] == 0.0f) printf(" %s=?", filterNames[i]);
+    else printf(" %s=%.2fms", filterNames[i], filterCost[i]);
+  }
+  printf(" )\n");
+}
+
+// returns TRUE if a query was started
+// (only one query is in flight, and its result is read without waiting on the GPU)
+static u8 begin_filter_query(void) {
+  if (filterQueryPending) {
+    GLuint available = 0;
+    glGetQueryObjectuiv(filterQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) return FALSE;
+
+    GLuint ns;
+    glGetQueryObjectuiv(filterQuery, GL_QUERY_RESULT, &ns);
+    float ms = ns / 1000000.0f;
+    float *cost = &filterCost[filterQueryMode];
+    *cost = *cost == 0.0f ? ms : *cost + (ms - *cost) * 0.1f;
+    filterQueryPending = FALSE;
+  }
+  filterQueryMode = filterMode;
+  glBeginQuery(GL_TIME_ELAPSED, filterQuery);
+  return TRUE;
+}
+
+static void end_filter_query(void) {
+  glEndQuery(GL_TIME_ELAPSED);
+  filterQueryPending = TRUE;
+}
+
+// where the camera of each skipped face is, relative to the current camera
+static void upload_face_cameras(void) {
+  GLfloat ages[6], rotations[6*9], origins[6*3], fars[6];
+  u8 i, r, c;
+  for (i=0; i<6; i++) {
+    struct FaceSchedule *f = &faceSchedule[i];
+    ages[i] = f->age;
+    fars[i] = f->far;
+
+    // current camera space to the face's camera space (its basis transposed × current basis)
+    for (c=0; c<3; c++) {
+      for (r=0; r<3; r++) {
+        const float *a = &f->basis[3*r], *b = &camBasis[3*c];
+        rotations[9*i + 3*c + r] = a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+      }
+    }
+
+    // current camera position in the face's camera space
+    float d[3] = { camPos[0] - f->pos[0], camPos[1] - f->pos[1], camPos[2] - f->pos[2] };
+    for (r=0; r<3; r++) {
+      const float *a = &f->basis[3*r];
+      origins[3*i + r] = a[0]*d[0] + a[1]*d[1] + a[2]*d[2];
+    }
+  }
+  if (UNIFORM_CHANGED(faceAges, ages)) glUniform1fv(quad->faceAges, 6, ages);
+  if (UNIFORM_CHANGED(faceRotations, rotations)) glUniformMatrix3fv(quad->faceRotations, 6, GL_FALSE, rotations);
+  if (UNIFORM_CHANGED(faceOrigins, origins)) glUniform3fv(quad->faceOrigins, 6, origins);
+  if (UNIFORM_CHANGED(faceFars, fars)) glUniform1fv(quad->faceFars, 6, fars);
+}
+
+static void render_quad(void) {
+  clipping = FALSE;
+  restore_viewport();
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
   glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA); // colors are already premultiplied, see previous usage of glBlendFuncSeparate
 
-  u32 w,h;
+  u8 i;
+  u32 w,h;
+  gfx_get_dimensions(&w, &h);
+  update_aspect(w,h);
+
+  glViewport(0, 0, w, h);
+
+  glDisable(GL_DEPTH_TEST);
+  glDepthMask(GL_FALSE);
+
+  extern void gfx_unload_current_shader(void);
+  gfx_unload_current_shader();
+
+  // only runs the projection when its knobs (or the window) change
+  update_rays(w,h);
+  glEnable(GL_BLEND);
+
+  quad = quad_variant();
+  glUseProgram(quad->prog);
+  GLfloat mobiusZoom = getMobiusZoom();
+  GLint isZooming = zooming;
+  GLfloat screenSize[2] = { w, h };
+  if (UNIFORM_CHANGED(fov, &fov)) glUniform1f(quad->fov, fov);
+  if (UNIFORM_CHANGED(mobiusZoom, &mobiusZoom)) glUniform1f(quad->mobiusZoom, mobiusZoom);
+  if (UNIFORM_CHANGED(zooming, &isZooming)) glUniform1i(quad->zooming, isZooming);
+  if (UNIFORM_CHANGED(screenSize, screenSize)) glUniform2f(quad->screenSize, w, h);
+  if (UNIFORM_CHANGED(skyBasis, camBasis)) glUniformMatrix3fv(quad->skyBasis, 1, GL_FALSE, camBasis);
+  if (UNIFORM_CHANGED(viewRotation, viewRotation)) glUniformMatrix3fv(quad->viewRotation, 1, GL_FALSE, viewRotation);
+  if (profileOn) {
+    if (UNIFORM_CHANGED(profileCpu, profileCpu)) glUniform1fv(quad->profileCpu, PROFILE_STAGES, profileCpu);
+    if (UNIFORM_CHANGED(profileGpu, profileGpu)) glUniform1fv(quad->profileGpu, PROFILE_STAGES, profileGpu);
+  }
+
+  if (loggedFilterMode != filterMode) {
+    loggedFilterMode = filterMode;
+    log_filter_cost();
+  }
+  // (extra frames only redraw the quad, so they'd skew the cost of the filter)
+  u8 timing = !viewFrame && begin_filter_query();
+
+  GLfloat sizes[6];
+  for (i=0; i<6; i++) {
+    sizes[i] = allocatedSize[i];
+    // (mipmaps are kept until the face is rendered again, or set up for another filter)
+    u8 refilter = faceFilter[i] != filterMode;
+    u8 remip = uses_mipmaps() && faceUsage[i].used && allocatedSize[i] > 0 && (!faceMipped[i] || refilter);
+    if (refilter || remip) {
+      edit_unit(faceUnits[i], faceTextureColor[i]);
+      if (refilter) {
+        set_face_filter(allocatedSize[i]);
+        faceFilter[i] = filterMode;
+      }
+      if (remip) glGenerateMipmap(GL_TEXTURE_2D);
+      faceMipped[i] = remip;
+    } else {
+      bind_unit(faceUnits[i], faceTextureColor[i]);
+    }
+    bind_unit(faceDepthUnits[i], faceTextureDepth[i]);
+  }
+  if (UNIFORM_CHANGED(faceSizes, sizes)) glUniform1fv(quad->faceSizes, 6, sizes);
+  upload_face_cameras();
+  bind_unit(rayUnit, rayTexture);
+  bind_unit(skyUnit, skyTexture);
+  reset_active_unit();
+  draw_quad_verts();
+
+  if (timing) end_filter_query();
+
+  glEnable(GL_DEPTH_TEST);
+  glDepthMask(GL_TRUE);
+
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // restore normal blending
+}
+
+//------------------------------------------------------------------------------
+// Fast view (redrawing the projection at the display's refresh rate between game ticks)
+//------------------------------------------------------------------------------
+
+// The game ticks at 30Hz, but the cubemap holds the whole view around the camera,
+// so a turn of the camera only needs the quad pass. Between ticks, we poll the
+// controller before each display refresh, redraw the projection turned by the
+// yaw that the stick and C-buttons held since the tick will give the camera, and
+// lay the tick's HUD back over it.
+//
+// How far the camera turns for a given input depends on its mode, so the gain is
+// learned from the ticks themselves: the yaw of the camera over a tick divided by
+// the turn input held during it. Extra frames only use the time the tick leaves
+// over, so the game loop is never held back for them.
+
+static u8 fastView = FALSE;
+static int savedSwapInterval;
+static u8 viewVsync; // each swap waits for the display refresh
+
+// camera basis of the previous tick (see camBasis)
+static float prevCamBasis[9];
+
+// rotations faster than this (radians per tick) are camera cuts, and not learned from
+#define MAX_VIEW_TURN 0.5f
+
+// turn input (C-right - C-left + stick x, about -2 to 2) held during the tick
+static float tickTurnInput;
+
+// yaw of the camera per tick per unit of turn input (learned, see update_view_turn_gain)
+static float viewTurnGain;
+
+// time (performance counter) taken by a tick, and by an extra frame
+static Uint64 tickCost, viewFrameCost;
+static Uint64 lastViewFramesEnd;
+
+// HUD of the tick (drawn after the quad pass), premultiplied
+static GLuint overlayFrameBuffer;
+static GLuint overlayTexture;
+static u32 overlayWidth, overlayHeight;
+static u8 overlayActive; // the rest of this tick's display list goes to the overlay
+static u8 overlayReady;  // the overlay has this tick's HUD
+
+static void toggle_fast_view(void) {
+  fastView = !fastView;
+  if (fastView) {
+    savedSwapInterval = SDL_GL_GetSwapInterval();
+    viewVsync = SDL_GL_SetSwapInterval(1) == 0;
+    lastViewFramesEnd = 0;
+  } else {
+    SDL_GL_SetSwapInterval(savedSwapInterval);
+  }
+  printf("fast view: %s%s\n", fastView ? "on" : "off", fastView && !viewVsync ? " (no vsync, paced by timer)" : "");
+}
+
+// turn input of a controller state, with the game's dead zone on the stick
+static float turn_input(u16 buttons, s16 stickX) {
+  float turn = ((buttons & R_CBUTTONS) ? 1.0f : 0.0f) - ((buttons & L_CBUTTONS) ? 1.0f : 0.0f);
+  if (stickX >= 8) turn += (stickX - 6) / 64.0f;
+  if (stickX <= -8) turn += (stickX + 6) / 64.0f;
+  return turn;
+}
+
+// (called at the start of each tick, see flexfov_update_input)
+static void record_tick_turn_input(void) {
+  tickTurnInput = turn_input(gPlayer1Controller->buttonDown, gPlayer1Controller->rawStickX);
+}
+
+// turn input of the controller right now (between ticks)
+// (read from the SDL and keyboard backends themselves, since osContGetReadData
+//  also reads the recorded TAS backend, which would play a frame of it per call)
+static float poll_turn_input(void) {
+  extern void gfx_handle_events(void);
+  OSContPad pad;
+  memset(&pad, 0, sizeof(pad));
+  gfx_handle_events(); // (the keyboard is read from window events)
+  controller_sdl.read(&pad);
+  controller_keyboard.read(&pad);
+  return turn_input(pad.button, pad.stick_x);
+}
+
+// yaw of a camera basis (about the world's up axis)
+static float basis_yaw(const float *basis) {
+  return atan2f(basis[6], basis[8]);
+}
+
+// learn the gain from the last tick, if its input turned the camera
+static void update_view_turn_gain(void) {
+  float yaw = basis_yaw(camBasis) - basis_yaw(prevCamBasis);
+  if (yaw > 3.14159f) yaw -= 2*3.14159f;
+  if (yaw < -3.14159f) yaw += 2*3.14159f;
+  if (fabsf(yaw) > MAX_VIEW_TURN || fabsf(tickTurnInput) < 0.25f) return;
+  viewTurnGain = 0.5f*viewTurnGain + 0.5f*(yaw / tickTurnInput);
+}
+
+// Turn of the camera space by `yaw` about the world's up axis,
+// as (basis transposed × turned basis)
+// (column-major like camBasis, see viewRotation in flexfov.frag)
+static void turn_view(float yaw, GLfloat *m) {
+  memcpy(m, identityRotation, sizeof(identityRotation));
+  if (fabsf(yaw) < 1e-4f) return;
+  float s = sinf(yaw), c = cosf(yaw);
+  float turned[9];
+  u8 r, k;
+  for (k=0; k<3; k++) {
+    const float *b = &camBasis[3*k];
+    turned[3*k]   =  b[0]*c + b[2]*s;
+    turned[3*k+1] =  b[1];
+    turned[3*k+2] = -b[0]*s + b[2]*c;
+  }
+  for (k=0; k<3; k++) {
+    for (r=0; r<3; r++) {
+      const float *a = &camBasis[3*r], *b = &turned[3*k];
+      m[3*k + r] = a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+    }
+  }
+}
+
+// send the rest of the tick's display list (the HUD) to the overlay
+// (called after the quad pass)
+static void begin_overlay(void) {
+  if (!fastView) return;
+  u32 w, h;
+  gfx_get_dimensions(&w, &h);
+  if (!overlayFrameBuffer) {
+    glGenFramebuffers(1, &overlayFrameBuffer);
+    glGenTextures(1, &overlayTexture);
+  }
+  if (w != overlayWidth || h != overlayHeight) {
+    edit_unit(overlayUnit, overlayTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    reset_active_unit();
+    glBindFramebuffer(GL_FRAMEBUFFER, overlayFrameBuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, overlayTexture, 0);
+    overlayWidth = w;
+    overlayHeight = h;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, overlayFrameBuffer);
+  glDisable(GL_SCISSOR_TEST);
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glEnable(GL_SCISSOR_TEST);
+
+  // premultiply, like the cubefaces (see init_cubeside)
+  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  overlayActive = TRUE;
+}
+
+// lay the overlay over the projection
+static void draw_overlay(void) {
+  u32 w, h;
+  gfx_get_dimensions(&w, &h);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, w, h);
+  glDisable(GL_SCISSOR_TEST);
+  glDisable(GL_DEPTH_TEST);
+  glDepthMask(GL_FALSE);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+  extern void gfx_unload_current_shader(void);
+  gfx_unload_current_shader();
+  glUseProgram(overlayProg);
+  glUniform2f(overlayScreenSize, w, h);
+  bind_unit(overlayUnit, overlayTexture);
+  reset_active_unit();
+  draw_quad_verts();
+
+  glEnable(GL_SCISSOR_TEST);
+  glEnable(GL_DEPTH_TEST);
+  glDepthMask(GL_TRUE);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // restore normal blending
+  restore_viewport();
+}
+
+static void capture_window(void);
+static void pace_frames(void);
+
+// called by the renderer at the end of each display list (see patch.diff)
+void flexfov_end_frame(void) {
+  if (overlayActive) {
+    overlayActive = FALSE;
+    draw_overlay();
+    overlayReady = TRUE;
+  }
+  capture_window();
+  pace_frames();
+}
+
+static void wait_until(Uint64 t) {
+  Uint64 now = SDL_GetPerformanceCounter();
+  if (now >= t) return;
+  SDL_Delay((Uint32)((t - now) * 1000 / SDL_GetPerformanceFrequency()));
+}
+
+// called by the game loop after each tick's frame is shown (see patch.diff)
+void flexfov_present_view_frames(void) {
+  Uint64 start = SDL_GetPerformanceCounter();
+  if (!fastView || !overlayReady) return;
+  overlayReady = FALSE;
+
+  // (what the tick took since the last extra frame, game and render)
+  Uint64 cost = lastViewFramesEnd ? start - lastViewFramesEnd : 0;
+  tickCost = tickCost ? (tickCost*3 + cost) / 4 : cost;
+  update_view_turn_gain();
+
+  SDL_Window *window = SDL_GL_GetCurrentWindow();
+  SDL_DisplayMode mode;
+  int hz = 60;
+  if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 && mode.refresh_rate > 0) {
+    hz = mode.refresh_rate;
+  }
+  u32 frames = hz / 30; // shown per tick (including the tick's own)
+  if (frames > 8) frames = 8;
+
+  Uint64 tick = SDL_GetPerformanceFrequency() / 30;
+  Uint64 interval = tick / (frames ? frames : 1);
+  u32 i;
+  viewFrame = TRUE;
+  for (i=1; i<frames; i++) {
+    // leave the next tick the time it needs
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (now + viewFrameCost + tickCost > start + tick) break;
+
+    // (with vsync, each swap already waits for its refresh)
+    if (!viewVsync) wait_until(start + i*interval);
+    Uint64 frameStart = SDL_GetPerformanceCounter();
+    float t = (float)(frameStart - start) / tick;
+    turn_view(viewTurnGain * poll_turn_input() * t, viewRotation);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDisable(GL_SCISSOR_TEST);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glEnable(GL_SCISSOR_TEST);
+    render_quad();
+    draw_overlay();
+    SDL_GL_SwapWindow(window);
+    Uint64 frameCost = SDL_GetPerformanceCounter() - frameStart;
+    viewFrameCost = viewFrameCost ? (viewFrameCost*3 + frameCost) / 4 : frameCost;
+  }
+  viewFrame = FALSE;
+  memcpy(viewRotation, identityRotation, sizeof(identityRotation));
+  lastViewFramesEnd = SDL_GetPerformanceCounter();
+}
+
+//------------------------------------------------------------------------------
+// Frame pacing (keeping the GPU at most one frame behind)
+//------------------------------------------------------------------------------
+
+// Environment:
+//   FLEXFOV_FRAME_LAG=n   frames the GPU may run behind the renderer (default 1, 0 turns it off)
+//
+// The renderer submits each frame as it runs the display list, and the GPU
+// works through it while the game builds the next one. Without a limit, the
+// driver queues up frames whenever the GPU is the slower of the two (seven
+// passes of the cubemap make that likely), adding a frame of input latency for
+// each. So each frame ends with a fence, and the frame after the lag waits for it,
+// which still lets the building of a frame overlap the GPU running the last one.
+
+#define MAX_FRAME_LAG 3
+
+static int frameLag = 1;
+static GLsync frameFences[MAX_FRAME_LAG + 1];
+static u32 frameFenceNext;
+
+static void init_frame_pacing(void) {
+  const char *lag = getenv("FLEXFOV_FRAME_LAG");
+  if (lag) frameLag = atoi(lag);
+  if (frameLag < 0) frameLag = 0;
+  if (frameLag > MAX_FRAME_LAG) frameLag = MAX_FRAME_LAG;
+}
+
+// fence the frame just submitted, and wait for the one `frameLag` frames before it
+// (called at the end of each display list)
+static void pace_frames(void) {
+#ifndef USE_GLES // (no fences in GLES 2)
+  if (frameLag == 0) return;
+  u32 n = frameLag + 1;
+  GLsync *fence = &frameFences[frameFenceNext];
+  *fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  frameFenceNext = (frameFenceNext + 1) % n;
+
+  GLsync *oldest = &frameFences[frameFenceNext];
+  if (!*oldest) return;
+  Uint64 start = SDL_GetPerformanceCounter();
+  // (bounded, so a lost context can't hang the game)
+  glClientWaitSync(*oldest, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+  glDeleteSync(*oldest);
+  *oldest = 0;
+  profile_smooth(&frameWaitMs, (float)((double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency()));
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Capture (recording the projected frames and the 360° cubemap to files)
+//------------------------------------------------------------------------------
+
+// Environment:
+//   FLEXFOV_CAPTURE=file.y4m       record the projected frames (with the HUD)
+//   FLEXFOV_CAPTURE_360=file.y4m   record the cubemap, remapped to an equirect
+//   FLEXFOV_CAPTURE_360_SIZE=WxH   size of the equirect (default 2048x1024)
+//
+// The files are YUV4MPEG2 (4:4:4 at 30fps, one frame per tick), which ffmpeg reads.
+// The equirect is around the camera (centered on its forward), and is black where
+// the sky is, since the sky isn't part of the cubemap (see Sky panorama).
+// While it is recorded, every face is rendered whole every frame (see wholeCube),
+// rather than only the faces and regions that the projection samples.
+//
+// Reading pixels straight into memory would wait for the GPU to finish the frame.
+// Instead, each frame is read into a pixel buffer from a ring CAPTURE_RING deep,
+// which is only mapped frames later, once its fence has passed. Its pixels are then
+// copied to a queue CAPTURE_QUEUE deep, which a worker thread converts and writes out.
+// Frames are dropped rather than waited on (when the pixel buffers are all still in
+// flight or the queue is full), so the game never stalls and memory stays bounded.
+
+#ifdef USE_GLES
+
+// (no pixel buffers or fences in GLES 2)
+static void init_capture(void) {
+  if (getenv("FLEXFOV_CAPTURE") || getenv("FLEXFOV_CAPTURE_360")) printf("capture: not supported with GLES\n");
+}
+static void capture_faces(void) {}
+static void capture_window(void) {}
+
+#else
+
+#define CAPTURE_RING 3
+#define CAPTURE_QUEUE 4
+#define CAPTURE_REPORT_FRAMES 300 // (10 seconds)
+
+// frame being read back into a pixel buffer
+struct CaptureSlot {
+  GLuint pbo;
+  GLsync fence; // (0 when the slot is free)
+  u32 capacity, bytes;
+  u32 sizes[6]; // of each cubeface (360)
+};
+
+// frame waiting for the worker
+struct CaptureBuffer {
+  u8 *pixels;
+  u32 capacity;
+  u32 sizes[6];
+  u8 full; // (handed to the worker, guarded by captureLock)
+};
+
+struct CaptureStream {
+  const char *path;
+  FILE *file;
+  u8 faces; // reads the cubefaces (else the window)
+  u32 width, height; // of the video
+  struct CaptureSlot ring[CAPTURE_RING];
+  u32 ringNext; // slot of the next frame (the oldest one)
+  struct CaptureBuffer queue[CAPTURE_QUEUE];
+  u32 queueHead; // next buffer filled by the game
+  u32 queueTail; // next buffer written by the worker
+  u8 *yuv;                 // (worker)
+  struct FlexFovRays rays; // of each pixel of the equirect (worker)
+  u32 *remapped;           // (worker)
+
+  u32 frames, droppedBusy, droppedQueue, droppedSize;
+  double renderMs; // spent by the game reading back and queueing
+  u32 written;     // (guarded by captureLock)
+  double workerMs; // (guarded by captureLock)
+};
+
+static struct CaptureStream captureWindow;
+static struct CaptureStream captureCube;
+static struct CaptureStream *const captureStreams[2] = { &captureWindow, &captureCube };
+
+static SDL_Thread *captureThread;
+static SDL_mutex *captureLock;
+static SDL_cond *captureWake;
+static u8 captureStopping;
+static int captureThreads; // for remapping the equirect
+
+static double capture_ms(Uint64 start) {
+  return (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+// (FALSE if out of memory)
+static u8 start_y4m(struct CaptureStream *s, u32 w, u32 h) {
+  s->yuv = malloc((size_t)w * h * 3);
+  if (!s->yuv) return FALSE;
+  s->width = w;
+  s->height = h;
+  fprintf(s->file, "YUV4MPEG2 W%u H%u F30:1 Ip A1:1 C444\n", w, h);
+  return TRUE;
+}
+
+// stop a stream that can't record (before any of its frames are queued)
+static void close_capture(struct CaptureStream *s) {
+  u8 i;
+  for (i=0; i<CAPTURE_RING; i++) glDeleteBuffers(1, &s->ring[i].pbo);
+  fclose(s->file);
+  s->file = NULL;
+  free(s->yuv);
+  free(s->remapped);
+  flexfov_free_rays(&s->rays);
+  s->yuv = NULL;
+  s->remapped = NULL;
+}
+
+// convert RGBA rows to planar YUV (BT.601, studio range)
+// (bottom row first if flipped, as glReadPixels reads the window)
+static void write_y4m_frame(struct CaptureStream *s, const u8 *rgba, u8 flip) {
+  u32 w = s->width, h = s->height, x, y;
+  size_t n = (size_t)w * h;
+  u8 *Y = s->yuv, *U = Y + n, *V = U + n;
+  for (y=0; y<h; y++) {
+    const u8 *p = rgba + (size_t)(flip ? h-1-y : y) * w * 4;
+    for (x=0; x<w; x++, p+=4) {
+      int r = p[0], g = p[1], b = p[2];
+      *Y++ = (u8)(((66*r + 129*g + 25*b + 128) >> 8) + 16);
+      *U++ = (u8)(((-38*r - 74*g + 112*b + 128) >> 8) + 128);
+      *V++ = (u8)(((112*r - 94*g - 18*b + 128) >> 8) + 128);
+    }
+  }
+  fputs("FRAME\n", s->file);
+  fwrite(s->yuv, 1, n * 3, s->file);
+}
+
+// ray of each pixel of the equirect (rows from top to bottom, see flexfov_remap.h)
+static u8 build_equirect_rays(struct FlexFovRays *rays, u32 w, u32 h) {
+  if (!flexfov_alloc_rays(rays, w, h)) return FALSE;
+  u32 row, col;
+  size_t i = 0;
+  for (row=0; row<h; row++) {
+    float lat = 3.14159f * (0.5f - (row + 0.5f) / h);
+    for (col=0; col<w; col++, i++) {
+      float lon = 3.14159f * (2.0f * (col + 0.5f) / w - 1.0f);
+      rays->x[i] = sinf(lon) * cosf(lat);
+      rays->y[i] = sinf(lat);
+      rays->z[i] = cosf(lon) * cosf(lat);
+    }
+  }
+  return TRUE;
+}
+
+static void write_equirect_frame(struct CaptureStream *s, const struct CaptureBuffer *b) {
+  static const unsigned int black = 0;
+  struct FlexFovCube cube;
+  const u8 *p = b->pixels;
+  u8 i;
+  for (i=0; i<6; i++) {
+    // (a face that hasn't been rendered yet is black)
+    cube.faces[i] = b->sizes[i] ? (const unsigned int *)p : &black;
+    cube.sizes[i] = b->sizes[i] ? b->sizes[i] : 1;
+    p += (size_t)b->sizes[i] * b->sizes[i] * 4;
+  }
+  flexfov_remap(&cube, &s->rays, s->remapped, captureThreads);
+  write_y4m_frame(s, (const u8 *)s->remapped, FALSE);
+}
+
+static int capture_worker(void *data) {
+  SDL_LockMutex(captureLock);
+  for (;;) {
+    struct CaptureStream *s = NULL;
+    struct CaptureBuffer *b = NULL;
+    u8 i;
+    for (i=0; i<2 && !b; i++) {
+      s = captureStreams[i];
+      if (s->file && s->queue[s->queueTail].full) b = &s->queue[s->queueTail];
+    }
+    if (!b) {
+      // (the queues are drained before stopping)
+      if (captureStopping) break;
+      SDL_CondWait(captureWake, captureLock);
+      continue;
+    }
+    SDL_UnlockMutex(captureLock);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (s->faces) write_equirect_frame(s, b);
+    else write_y4m_frame(s, b->pixels, TRUE);
+    double ms = capture_ms(start);
+
+    SDL_LockMutex(captureLock);
+    b->full = FALSE;
+    s->queueTail = (s->queueTail + 1) % CAPTURE_QUEUE;
+    s->written++;
+    s->workerMs += ms;
+  }
+  SDL_UnlockMutex(captureLock);
+  return 0;
+}
+
+static void log_capture(struct CaptureStream *s) {
+  SDL_LockMutex(captureLock);
+  u32 written = s->written;
+  double workerMs = s->workerMs;
+  SDL_UnlockMutex(captureLock);
+  printf("capture: %s frames=%u written=%u dropped=%u (gpu busy %u, worker behind %u, resized %u) overhead=%.3fms/frame worker=%.2fms/frame\n",
+    s->path, s->frames, written, s->droppedBusy + s->droppedQueue + s->droppedSize,
+    s->droppedBusy, s->droppedQueue, s->droppedSize,
+    s->frames ? s->renderMs / s->frames : 0.0, written ? workerMs / written : 0.0);
+}
+
+// hand the pixels of a read back frame to the worker
+static void capture_queue(struct CaptureStream *s, struct CaptureSlot *slot) {
+  struct CaptureBuffer *b = &s->queue[s->queueHead];
+  SDL_LockMutex(captureLock);
+  u8 full = b->full;
+  SDL_UnlockMutex(captureLock);
+  if (full) {
+    s->droppedQueue++;
+    return;
+  }
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+  const void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot->bytes, GL_MAP_READ_BIT);
+  if (!pixels) {
+    s->droppedBusy++;
+    return;
+  }
+  if (b->capacity < slot->bytes) {
+    free(b->pixels);
+    b->pixels = malloc(slot->bytes);
+    b->capacity = b->pixels ? slot->bytes : 0;
+    if (!b->pixels) {
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      s->droppedQueue++;
+      return;
+    }
+  }
+  memcpy(b->pixels, pixels, slot->bytes);
+  memcpy(b->sizes, slot->sizes, sizeof(b->sizes));
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+
+  SDL_LockMutex(captureLock);
+  b->full = TRUE;
+  SDL_CondSignal(captureWake);
+  SDL_UnlockMutex(captureLock);
+  s->queueHead = (s->queueHead + 1) % CAPTURE_QUEUE;
+}
+
+// queue the frames that the GPU has finished reading back (oldest first, without waiting)
+static void capture_collect(struct CaptureStream *s) {
+  u32 i;
+  for (i=0; i<CAPTURE_RING; i++) {
+    struct CaptureSlot *slot = &s->ring[(s->ringNext + i) % CAPTURE_RING];
+    if (!slot->fence) continue;
+    GLenum status = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+    glDeleteSync(slot->fence);
+    slot->fence = 0;
+    capture_queue(s, slot);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// bind the pixel buffer of the next slot to read a frame into
+// (NULL if it is still in flight, dropping the frame)
+static struct CaptureSlot *capture_slot(struct CaptureStream *s, u32 bytes) {
+  struct CaptureSlot *slot = &s->ring[s->ringNext];
+  if (slot->fence) {
+    s->droppedBusy++;
+    return NULL;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+  if (slot->capacity < bytes) {
+    glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+    slot->capacity = bytes;
+  }
+  slot->bytes = bytes;
+  return slot;
+}
+
+static void capture_fence(struct CaptureStream *s, struct CaptureSlot *slot) {
+  slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  s->ringNext = (s->ringNext + 1) % CAPTURE_RING;
+}
+
+static void capture_frame_done(struct CaptureStream *s, Uint64 start) {
+  s->renderMs += capture_ms(start);
+  if (++s->frames % CAPTURE_REPORT_FRAMES == 0) log_capture(s);
+}
+
+// read back the cubefaces (called after the quad pass)
+static void capture_faces(void) {
+  struct CaptureStream *s = &captureCube;
+  if (!s->file) return;
+  Uint64 start = SDL_GetPerformanceCounter();
+  capture_collect(s);
+
+  u32 bytes = 0, offset = 0;
+  u8 i;
+  for (i=0; i<6; i++) bytes += allocatedSize[i] * allocatedSize[i] * 4;
+  struct CaptureSlot *slot = capture_slot(s, bytes);
+  if (slot) {
+    for (i=0; i<6; i++) {
+      u32 size = allocatedSize[i];
+      slot->sizes[i] = size;
+      if (!size) continue;
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, faceFrameBuffers[i]);
+      glReadPixels(0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, (void *)(uintptr_t)offset);
+      offset += size * size * 4;
+    }
+    capture_fence(s, slot);
+  }
+  capture_frame_done(s, start);
+}
+
+// read back the projected frame with its HUD (called at the end of each frame)
+static void capture_window(void) {
+  struct CaptureStream *s = &captureWindow;
+  if (!s->file) return;
+  Uint64 start = SDL_GetPerformanceCounter();
+  capture_collect(s);
+
+  // (the video has the size of the first frame)
+  u32 w, h;
+  gfx_get_dimensions(&w, &h);
+  if (!s->width && !start_y4m(s, w, h)) {
+    fprintf(stderr, "capture: out of memory for a %ux%u frame, not recording %s\n", w, h, s->path);
+    SDL_LockMutex(captureLock); // (the worker checks the file)
+    close_capture(s);
+    SDL_UnlockMutex(captureLock);
+    return;
+  }
+  if (w != s->width || h != s->height) {
+    s->droppedSize++;
+  } else {
+    struct CaptureSlot *slot = capture_slot(s, w * h * 4);
+    if (slot) {
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+      glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+      capture_fence(s, slot);
+    }
+  }
+  capture_frame_done(s, start);
+}
+
+static void finish_capture(void) {
+  SDL_LockMutex(captureLock);
+  captureStopping = TRUE;
+  SDL_CondSignal(captureWake);
+  SDL_UnlockMutex(captureLock);
+  SDL_WaitThread(captureThread, NULL);
+  u8 i;
+  for (i=0; i<2; i++) {
+    struct CaptureStream *s = captureStreams[i];
+    if (!s->file) continue;
+    fclose(s->file);
+    log_capture(s);
+  }
+}
+
+static u8 open_capture(struct CaptureStream *s, const char *path) {
+  if (!path || !*path) return FALSE;
+  s->file = fopen(path, "wb");
+  if (!s->file) {
+    perror(path);
+    return FALSE;
+  }
+  s->path = path;
+  u8 i;
+  for (i=0; i<CAPTURE_RING; i++) glGenBuffers(1, &s->ring[i].pbo);
+  return TRUE;
+}
+
+static void init_capture(void) {
+  captureThreads = SDL_GetCPUCount() / 2;
+  if (captureThreads < 1) captureThreads = 1;
+
+  u8 window = open_capture(&captureWindow, getenv("FLEXFOV_CAPTURE"));
+  u8 cube = open_capture(&captureCube, getenv("FLEXFOV_CAPTURE_360"));
+  if (cube) {
+    u32 w = 2048, h = 1024;
+    const char *size = getenv("FLEXFOV_CAPTURE_360_SIZE");
+    if (size && (sscanf(size, "%ux%u", &w, &h) != 2 || w < 2 || h < 1)) {
+      w = 2048;
+      h = 1024;
+    }
+    captureCube.faces = TRUE;
+    captureCube.remapped = malloc((size_t)w * h * 4);
+    if (!captureCube.remapped || !build_equirect_rays(&captureCube.rays, w, h) || !start_y4m(&captureCube, w, h)) {
+      // (keep running without the 360° capture)
+      fprintf(stderr, "capture: out of memory for a %ux%u equirect, not recording %s\n", w, h, captureCube.path);
+      close_capture(&captureCube);
+      cube = FALSE;
+    }
+    wholeCube = cube;
+  }
+  if (!window && !cube) return;
+
+  captureLock = SDL_CreateMutex();
+  captureWake = SDL_CreateCond();
+  captureThread = SDL_CreateThread(capture_worker, "flexfov capture", NULL);
+  atexit(finish_capture);
+  if (window) printf("capture: recording the projection to %s\n", captureWindow.path);
+  if (cube) printf("capture: recording the cubemap to %s (%ux%u equirect)\n", captureCube.path, captureCube.width, captureCube.height);
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Benchmark (replaying recorded inputs, see bench.sh)
+//------------------------------------------------------------------------------
+
+// Environment:
+//   FLEXFOV_RECORD=file        record the controller at our input tap
+//   FLEXFOV_REPLAY=file        replay it instead of reading the controller (then exit)
+//   FLEXFOV_BENCH_FRAMES=n     stop replaying after n frames
+//   FLEXFOV_BENCH_FOV=deg      hold the fov
+//   FLEXFOV_BENCH_PITCH=rad    hold the pitch used by the projection
+//   FLEXFOV_BENCH_OUT=file     per-frame timings (csv, default flexfov_bench.csv)
+//   FLEXFOV_BENCH_GOLDEN=path  on the last of the n frames, write the rays, the projection and
+//                              the cubefaces, to compare against the CPU mirror (flexfov_bench -g)
+//
+// The game is deterministic from power-on given its inputs and save file,
+// so a replay renders the same frames every time.
+
+static u8 benchStarted;
+static FILE *recordFile;
+static FILE *replayFile;
+static FILE *benchOut;
+static u32 benchFrame;
+static u32 benchFrames; // 0 for the whole recording
+static const char *goldenPath;
+static u8 goldenFrame; // this frame is written for the comparison
+
+// per-frame timings (ms), finishing the GL pipeline at each stage boundary
+// (so the GPU work of a stage is counted in that stage)
+enum BenchStage { BENCH_GEO, BENCH_FACES, BENCH_QUAD, BENCH_FRAME, BENCH_STAGES };
+static const char *benchStageNames[BENCH_STAGES] = { "geo", "faces", "quad", "frame" };
+static float benchTimes[BENCH_STAGES];
+static float *benchHistory[BENCH_STAGES]; // all frames, for the summary
+static u32 benchHistorySize;
+static Uint64 benchFacesStart, benchFrameStart;
+
+static float bench_ms(Uint64 start, Uint64 end) {
+  return (float)((double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency());
+}
+
+static void bench_start(void) {
+  benchStarted = TRUE;
+
+  const char *record = getenv("FLEXFOV_RECORD");
+  const char *replay = getenv("FLEXFOV_REPLAY");
+  const char *frames = getenv("FLEXFOV_BENCH_FRAMES");
+  const char *fixedFov = getenv("FLEXFOV_BENCH_FOV");
+  const char *fixedPitch = getenv("FLEXFOV_BENCH_PITCH");
+  const char *out = getenv("FLEXFOV_BENCH_OUT");
+  goldenPath = getenv("FLEXFOV_BENCH_GOLDEN");
+  if (goldenPath && !*goldenPath) goldenPath = NULL;
+
+  if (record) {
+    recordFile = fopen(record, "w");
+    if (!recordFile) perror(record);
+  }
+  if (replay) {
+    replayFile = fopen(replay, "r");
+    if (!replayFile) { perror(replay); exit(1); }
+    benchOut = fopen(out ? out : "flexfov_bench.csv", "w");
+    if (benchOut) fprintf(benchOut, "frame,on,faces_used,geo_ms,faces_ms,quad_ms,frame_ms\n");
+  }
+  if (frames) benchFrames = atoi(frames);
+  if (fixedFov) { benchFixedFov = TRUE; benchFov = atof(fixedFov); }
+  if (fixedPitch) { benchFixedPitch = TRUE; benchPitch = atof(fixedPitch); }
+}
+
+static int compare_floats(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+  return x < y ? -1 : x > y;
+}
+
+// print a summary of the replay that can be diffed between builds
+static void bench_finish(void) {
+  if (benchOut) fclose(benchOut);
+  printf("bench: frames=%u fov=%s pitch=%s\n", benchHistorySize,
+    getenv("FLEXFOV_BENCH_FOV") ? getenv("FLEXFOV_BENCH_FOV") : "free",
+    getenv("FLEXFOV_BENCH_PITCH") ? getenv("FLEXFOV_BENCH_PITCH") : "free");
+  u8 i;
+  for (i=0; i<BENCH_STAGES && benchHistorySize > 0; i++) {
+    float *t = benchHistory[i];
+    u32 n = benchHistorySize;
+    double sum = 0;
+    u32 j;
+    for (j=0; j<n; j++) sum += t[j];
+    qsort(t, n, sizeof(float), compare_floats);
+    printf("bench: %-5s mean=%.3fms median=%.3fms p95=%.3fms max=%.3fms\n",
+      benchStageNames[i], sum/n, t[n/2], t[(u32)(n*0.95f)], t[n-1]);
+  }
+  exit(0);
+}
+
+// Golden frame: the shader's rays and projection, with the cubefaces and knobs they
+// came from, so flexfov_bench can check the CPU mirror (flexfov_proj.c) against it.
+// The frame renders every face whole and takes nearest texels (SS9), so that each
+// pixel is a blend of the texels around the one the CPU looks up.
+
+static void begin_golden_frame(void) {
+  filterMode = FLEXFOV_FILTER_SS9;
+  scheduleMode = FLEXFOV_SCHEDULE_ALL;
+  wholeCube = TRUE;
+  usageWidth = 0; // (recompute the usage as a whole cube)
+  useRubix = FALSE;
+  goldenFrame = TRUE;
+}
+
+#ifdef USE_GLES
+
+static void write_golden_frame(void) {
+  printf("bench: golden frame not supported with GLES\n");
+  goldenFrame = FALSE;
+}
+
+#else
+
+// (rows from bottom to top, as read back)
+static void write_golden_ppm(const char *suffix, const u8 *rgba, u32 w, u32 h, u8 flip) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s%s", goldenPath, suffix);
+  FILE *f = fopen(path, "wb");
+  if (!f) { perror(path); return; }
+  fprintf(f, "P6\n%u %u\n255\n", w, h);
+  u32 x, y;
+  for (y=0; y<h; y++) {
+    const u8 *row = rgba + (size_t)(flip ? h-1-y : y) * w * 4;
+    for (x=0; x<w; x++) fwrite(row + x*4, 1, 3, f);
+  }
+  fclose(f);
+}
+
+// (called after the quad pass, before the HUD is drawn over it)
+static void write_golden_frame(void) {
+  goldenFrame = FALSE;
+  u32 w, h;
   gfx_get_dimensions(&w, &h);
-  update_aspect(w,h);
+  u32 largest = w*h;
+  u8 i;
+  for (i=0; i<6; i++) if (allocatedSize[i] * allocatedSize[i] > largest) largest = allocatedSize[i] * allocatedSize[i];
+  float *floats = malloc((size_t)w * h * 3 * sizeof(float));
+  u8 *rgba = malloc((size_t)largest * 4);
+  if (!floats || !rgba) {
+    printf("bench: out of memory for the golden frame\n");
+    free(floats);
+    free(rgba);
+    return;
+  }
+  char path[1024];
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
-  glViewport(0, 0, w, h);
+  // rays (PFM, which also has its rows from bottom to top)
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, rayFrameBuffer);
+  glReadPixels(0, 0, w, h, GL_RGB, GL_FLOAT, floats);
+  snprintf(path, sizeof(path), "%s.rays.pfm", goldenPath);
+  FILE *f = fopen(path, "wb");
+  if (f) {
+    fprintf(f, "PF\n%u %u\n-1.0\n", w, h);
+    fwrite(floats, sizeof(float), (size_t)w * h * 3, f);
+    fclose(f);
+  } else {
+    perror(path);
+  }
 
-  glDisable(GL_DEPTH_TEST);
-  glDepthMask(GL_FALSE);
-  glEnable(GL_BLEND);
+  // projection
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+  write_golden_ppm(".ppm", rgba, w, h, TRUE);
 
-  extern void gfx_unload_current_shader(void);
-  gfx_unload_current_shader();
+  // cubefaces (rows in the order of t, see FlexFovCube)
+  for (i=0; i<6; i++) {
+    u32 size = allocatedSize[i];
+    if (!size) continue;
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".face%d.ppm", i);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, faceFrameBuffers[i]);
+    glReadPixels(0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+    write_golden_ppm(suffix, rgba, size, size, FALSE);
+  }
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
 
-  glUseProgram(quadProg);
-  glUniform1f(quadCamPitch, camPitch);
-  glUniform1i(quadUseRubix, useRubix);
-  glUniform1i(quadUseCube, useCube);
-  glUniform1f(quadFov, fov);
-  glUniform1f(quadMobiusZoom, getMobiusZoom());
-  glUniform1i(quadControlsOn, controlsOn);
-  glUniform1i(quadZooming, zooming);
-  glUniform1f(quadPixelSize, pixelSize);
-
-  glEnableVertexAttribArray(quadAttrXY); glVertexAttribPointer(quadAttrXY, 2, GL_FLOAT, GL_FALSE, quadStride*sizeof(float), NULL);
-  glEnableVertexAttribArray(quadAttrUV); glVertexAttribPointer(quadAttrUV, 2, GL_FLOAT, GL_FALSE, quadStride*sizeof(float), (void*)(2*sizeof(float)));
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, cubeTextureColor);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(quadVerts), quadVerts, GL_STREAM_DRAW);
-    glDrawArrays(GL_TRIANGLES, 0, numQuadVerts);
-  glDisableVertexAttribArray(quadAttrXY);
-  glDisableVertexAttribArray(quadAttrUV);
+  // knobs (as the ray pass gets them, see update_rays)
+  snprintf(path, sizeof(path), "%s.txt", goldenPath);
+  f = fopen(path, "w");
+  if (f) {
+    fprintf(f, "%.9g %.9g %.9g %d\n", rayKnobs.fov, rayKnobs.camPitch, rayKnobs.mobiusZoom, rayKnobs.useCube);
+    fclose(f);
+  } else {
+    perror(path);
+  }
 
-  glEnable(GL_DEPTH_TEST);
-  glDepthMask(GL_TRUE);
+  free(floats);
+  free(rgba);
+  printf("bench: golden frame written to %s.*\n", goldenPath);
+}
 
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // restore normal blending
+#endif
+
+// record or replay the controller (called at our input tap every frame)
+static void bench_input(void) {
+  if (!benchStarted) bench_start();
+
+  struct Controller *c = gPlayer1Controller;
+  if (replayFile) {
+    if (benchFrames > 0 && benchFrame >= benchFrames) bench_finish();
+    u32 down, pressed;
+    float x, y, mag;
+    if (fscanf(replayFile, "%u %u %f %f %f", &down, &pressed, &x, &y, &mag) != 5) bench_finish();
+    c->buttonDown = gPlayer3Controller->buttonDown = down;
+    c->buttonPressed = gPlayer3Controller->buttonPressed = pressed;
+    c->stickX = gPlayer3Controller->stickX = x;
+    c->stickY = gPlayer3Controller->stickY = y;
+    c->stickMag = gPlayer3Controller->stickMag = mag;
+  }
+  if (recordFile) {
+    fprintf(recordFile, "%u %u %.9g %.9g %.9g\n", c->buttonDown, c->buttonPressed, c->stickX, c->stickY, c->stickMag);
+    fflush(recordFile);
+  }
+  if (benchFixedFov) fov = benchFov;
+  benchFrame++;
+  if (goldenPath && benchFrames > 0 && benchFrame == benchFrames) begin_golden_frame();
+}
+
+// write the timings of the previous frame (its display list has run by now)
+static void bench_next_frame(void) {
+  if (!benchOut) return;
+  Uint64 now = SDL_GetPerformanceCounter();
+  if (benchFrameStart) {
+    benchTimes[BENCH_FRAME] = bench_ms(benchFrameStart, now);
+    u8 used = 0, i;
+    for (i=0; i<6; i++) used += faceUsage[i].used;
+    fprintf(benchOut, "%u,%d,%d,%.3f,%.3f,%.3f,%.3f\n", benchFrame, flexfov_is_on(), used,
+      benchTimes[BENCH_GEO], benchTimes[BENCH_FACES], benchTimes[BENCH_QUAD], benchTimes[BENCH_FRAME]);
+
+    if ((benchHistorySize & (benchHistorySize-1)) == 0) {
+      u32 capacity = benchHistorySize ? benchHistorySize*2 : 256;
+      for (i=0; i<BENCH_STAGES; i++) benchHistory[i] = realloc(benchHistory[i], capacity * sizeof(float));
+    }
+    for (i=0; i<BENCH_STAGES; i++) benchHistory[i][benchHistorySize] = benchTimes[i];
+    benchHistorySize++;
+  }
+  benchFrameStart = now;
+  benchFacesStart = 0;
+  memset(benchTimes, 0, sizeof(benchTimes));
+}
+
+static void bench_faces_begin(void) {
+  if (!benchOut || benchFacesStart) return;
+  glFinish();
+  benchFacesStart = SDL_GetPerformanceCounter();
+}
+
+static void bench_faces_end(void) {
+  if (!benchOut || !benchFacesStart) return;
+  glFinish();
+  benchTimes[BENCH_FACES] = bench_ms(benchFacesStart, SDL_GetPerformanceCounter());
+}
+
+static void bench_quad(void) {
+  if (!benchOut) {
+    render_quad();
+    return;
+  }
+  Uint64 start = SDL_GetPerformanceCounter();
+  render_quad();
+  glFinish();
+  benchTimes[BENCH_QUAD] = bench_ms(start, SDL_GetPerformanceCounter());
+  if (goldenFrame) write_golden_frame();
+}
+
+//------------------------------------------------------------------------------
+// Vertex cache (sharing the vertex loads of the replayed world pass across cubefaces)
+//------------------------------------------------------------------------------
+
+// Every cubeface replays the same world pass, so it loads the same vertices in
+// the same order under the same modelview, and gets the same lighting, fog and
+// texture coords (see flexfov_set_light_direction and flexfov_set_fog_scale).
+// The first face rendered each frame transforms them as usual, and we keep the
+// results with their camera space positions. The other faces only swap the axes
+// of those positions to their side and project them (on worker threads, see
+// Replay workers).
+
+struct VertexLoad {
+  const Vtx *src;
+  u32 n;
+  u32 first; // index of its first vertex in the cache
+  Mat4 modelview;
+};
+
+static struct VertexLoad *vertexLoads;
+static u32 numVertexLoads, vertexLoadCapacity;
+static struct FlexFovLoadedVertex *cachedVertices;
+static Vec3f *cachedPositions; // camera space of the front face
+static u32 numCachedVertices, cachedVertexCapacity;
+
+enum VERTEX_CACHE { VERTEX_CACHE_OFF, VERTEX_CACHE_RECORD, VERTEX_CACHE_REPLAY };
+static u8 vertexCacheState;
+static u8 vertexCacheRecorded; // the first face of this frame has been recorded
+static float recordedAspectX;  // of the recorded face
+static u8 replaySide;          // face being replayed
+static u32 replayLoad;         // next load of the face being replayed
+
+// vertices being transformed by the renderer, copied into the cache at the next load
+static struct FlexFovLoadedVertex *pendingDest;
+static u32 pendingFirst, pendingCount;
+
+// projection of the recorded world pass
+static Mat4 vertexProjection;
+
+// axis swap from the front camera space to each face's
+// (its camera space axis j is axis axes[j] of the front camera, times signs[j])
+struct AxisSwap {
+  u8 axes[3];
+  float signs[3];
+};
+static struct AxisSwap faceSwaps[6];
+
+static void init_face_swaps(void) {
+  u8 side, i, j;
+  for (side=0; side<6; side++) {
+    Mat4 rotation;
+    side_rotation(rotation, side);
+    for (j=0; j<3; j++) {
+      for (i=0; i<3; i++) {
+        if (rotation[i][j] != 0.0f) {
+          faceSwaps[side].axes[j] = i;
+          faceSwaps[side].signs[j] = rotation[i][j];
+        }
+      }
+    }
+  }
+}
+
+static void replay_workers_dispatch(u8 from);
+static void replay_workers_wait(void);
+static u8 replay_workers_fetch(u8 side, u32 first, u32 n, struct FlexFovLoadedVertex *dest);
+
+static void vertex_cache_flush(void) {
+  if (!pendingDest) return;
+  memcpy(cachedVertices + pendingFirst, pendingDest, pendingCount * sizeof(*pendingDest));
+  pendingDest = NULL;
+}
+
+static void vertex_cache_begin_frame(void) {
+  vertex_cache_flush();
+  vertexCacheState = VERTEX_CACHE_OFF;
+  vertexCacheRecorded = FALSE;
+}
+
+static void vertex_cache_begin_face(u8 side) {
+  vertex_cache_flush();
+  if (!replayFaces || !shareVertices) {
+    vertexCacheState = VERTEX_CACHE_OFF;
+    return;
+  }
+
+  if (!vertexCacheRecorded) {
+    vertexCacheState = VERTEX_CACHE_RECORD;
+    vertexCacheRecorded = TRUE;
+    numVertexLoads = 0;
+    numCachedVertices = 0;
+    return;
+  }
+
+  // (the first replayed face hands the rest to the workers)
+  if (vertexCacheState == VERTEX_CACHE_RECORD) replay_workers_dispatch(side);
+  vertexCacheState = VERTEX_CACHE_REPLAY;
+  replaySide = side;
+  replayLoad = 0;
+}
+
+static void vertex_cache_end(void) {
+  vertex_cache_flush();
+  replay_workers_wait(); // (so the cache isn't read while the next frame is built)
+  vertexCacheState = VERTEX_CACHE_OFF;
+}
+
+static void vertex_cache_grow(u32 loads, u32 vertices) {
+  if (loads > vertexLoadCapacity) {
+    vertexLoadCapacity = loads > vertexLoadCapacity * 2 ? loads : vertexLoadCapacity * 2;
+    vertexLoads = realloc(vertexLoads, vertexLoadCapacity * sizeof(*vertexLoads));
+  }
+  if (vertices > cachedVertexCapacity) {
+    cachedVertexCapacity = vertices > cachedVertexCapacity * 2 ? vertices : cachedVertexCapacity * 2;
+    cachedVertices = realloc(cachedVertices, cachedVertexCapacity * sizeof(*cachedVertices));
+    cachedPositions = realloc(cachedPositions, cachedVertexCapacity * sizeof(*cachedPositions));
+  }
+}
+
+static void record_vertices(const Vtx *src, u32 n, struct FlexFovLoadedVertex *dest, float m[4][4], float aspectX) {
+  recordedAspectX = aspectX;
+  vertex_cache_grow(numVertexLoads + 1, numCachedVertices + n);
+
+  struct VertexLoad *load = &vertexLoads[numVertexLoads++];
+  load->src = src;
+  load->n = n;
+  load->first = numCachedVertices;
+  memcpy(load->modelview, m, sizeof(load->modelview));
+
+  // (front camera space, since each face's rotation is in its projection)
+  u32 i;
+  for (i=0; i<n; i++) {
+    const s16 *v = src[i].v.ob;
+    float *p = cachedPositions[load->first + i];
+    p[0] = v[0] * m[0][0] + v[1] * m[1][0] + v[2] * m[2][0] + m[3][0];
+    p[1] = v[0] * m[0][1] + v[1] * m[1][1] + v[2] * m[2][1] + m[3][1];
+    p[2] = v[0] * m[0][2] + v[1] * m[1][2] + v[2] * m[2][2] + m[3][2];
+  }
+  numCachedVertices += n;
+
+  // the renderer fills in the rest
+  pendingDest = dest;
+  pendingFirst = load->first;
+  pendingCount = n;
+}
+
+// project the cached vertices [first, first+n) to a face
+// (positions are cached in front camera space, whichever face was recorded)
+static void project_vertices(u8 side, u32 first, u32 n, struct FlexFovLoadedVertex *dest, float aspectX) {
+  float (*p)[4] = vertexProjection;
+  const u8 *axes = faceSwaps[side].axes;
+  const float *signs = faceSwaps[side].signs;
+  u32 i;
+  for (i=0; i<n; i++) {
+    const float *c = cachedPositions[first + i];
+    float e0 = signs[0] * c[axes[0]];
+    float e1 = signs[1] * c[axes[1]];
+    float e2 = signs[2] * c[axes[2]];
+
+    float x = e0 * p[0][0] + e1 * p[1][0] + e2 * p[2][0] + p[3][0];
+    float y = e0 * p[0][1] + e1 * p[1][1] + e2 * p[2][1] + p[3][1];
+    float z = e0 * p[0][2] + e1 * p[1][2] + e2 * p[2][2] + p[3][2];
+    float w = e0 * p[0][3] + e1 * p[1][3] + e2 * p[2][3] + p[3][3];
+    x *= aspectX;
+
+    // (same trivial clip rejection as gfx_sp_vertex)
+    struct FlexFovLoadedVertex *d = &dest[i];
+    *d = cachedVertices[first + i];
+    d->x = x;
+    d->y = y;
+    d->z = z;
+    d->w = w;
+    d->clip_rej = 0;
+    if (x < -w) d->clip_rej |= 1;
+    if (x > w) d->clip_rej |= 2;
+    if (y < -w) d->clip_rej |= 4;
+    if (y > w) d->clip_rej |= 8;
+    if (z < -w) d->clip_rej |= 16;
+    if (z > w) d->clip_rej |= 32;
+  }
+}
+
+// Called by gfx_sp_vertex before it transforms a load of vertices.
+// Returns TRUE if it has filled them in from the cache instead.
+u8 flexfov_replay_vertices(const Vtx *src, u32 n, struct FlexFovLoadedVertex *dest, float m[4][4], float aspectX) {
+  if (vertexCacheState == VERTEX_CACHE_OFF) return FALSE;
+  vertex_cache_flush();
+
+  if (vertexCacheState == VERTEX_CACHE_RECORD) {
+    record_vertices(src, n, dest, m, aspectX);
+    return FALSE;
+  }
+
+  if (replayLoad >= numVertexLoads) return FALSE;
+  struct VertexLoad *load = &vertexLoads[replayLoad++];
+  if (load->src != src || load->n != n || memcmp(load->modelview, m, sizeof(load->modelview)) != 0) return FALSE;
+  if (aspectX != recordedAspectX || !replay_workers_fetch(replaySide, load->first, n, dest)) {
+    project_vertices(replaySide, load->first, n, dest, aspectX);
+  }
+  return TRUE;
+}
+
+//------------------------------------------------------------------------------
+// Replay workers (projecting the shared vertices of each cubeface in parallel)
+//------------------------------------------------------------------------------
+
+// The six face passes can't be traversed concurrently, since the traversal and
+// the game's geo callbacks share the engine's globals (the matrix stack, the
+// display list head, the animation state, ...), and replaying the world pass
+// already traverses the world only once. What is left to split per face is the
+// vertex stage of the replay: once the first face has been recorded, the vertices
+// of every other face depend only on the cache and that face's rotation.
+// So the moment the renderer reaches the second face, each of the other faces
+// is projected by a worker into a segment of its own, and the renderer copies
+// each load out of its face's segment (waiting only if its worker isn't done yet).
+//
+// Environment:
+//   FLEXFOV_REPLAY_THREADS=n   number of workers (default one less than the cores, up to 5)
+
+#define MAX_REPLAY_WORKERS 5
+#define REPLAY_MIN_VERTICES 1024 // (fewer are projected by the renderer, as before)
+
+// segment of projected vertices of a face
+struct ReplaySegment {
+  struct FlexFovLoadedVertex *vertices;
+  u32 capacity;
+  u8 queued;  // (guarded by replayLock)
+  u8 done;    // (guarded by replayLock)
+  u8 ready;   // done was seen by the renderer (so it stops locking)
+  u8 pending; // dispatched this frame
+};
+
+static struct ReplaySegment replaySegments[6];
+static SDL_mutex *replayLock;
+static SDL_cond *replayWake;
+static SDL_cond *replayDone;
+static int numReplayWorkers;
+
+static int replay_worker(void *data) {
+  SDL_LockMutex(replayLock);
+  for (;;) {
+    u8 side;
+    for (side=0; side<6 && !replaySegments[side].queued; side++);
+    if (side == 6) {
+      SDL_CondWait(replayWake, replayLock);
+      continue;
+    }
+    struct ReplaySegment *s = &replaySegments[side];
+    s->queued = FALSE;
+    SDL_UnlockMutex(replayLock);
+
+    project_vertices(side, 0, numCachedVertices, s->vertices, recordedAspectX);
+
+    SDL_LockMutex(replayLock);
+    s->done = TRUE;
+    SDL_CondBroadcast(replayDone);
+  }
+  return 0;
+}
+
+static void init_replay_workers(void) {
+  init_face_swaps();
+
+  const char *threads = getenv("FLEXFOV_REPLAY_THREADS");
+  numReplayWorkers = threads ? atoi(threads) : SDL_GetCPUCount() - 1;
+  if (numReplayWorkers > MAX_REPLAY_WORKERS) numReplayWorkers = MAX_REPLAY_WORKERS;
+  if (numReplayWorkers <= 0) {
+    numReplayWorkers = 0;
+    replayWorkers = FALSE;
+    return;
+  }
+
+  replayLock = SDL_CreateMutex();
+  replayWake = SDL_CreateCond();
+  replayDone = SDL_CreateCond();
+  // (counting only the threads that start, and replaying on the main thread if none do,
+  //  since a queued face with no worker would never be done)
+  int i, started = 0;
+  for (i=0; i<numReplayWorkers && replayLock && replayWake && replayDone; i++) {
+    SDL_Thread *thread = SDL_CreateThread(replay_worker, "flexfov replay", NULL);
+    if (!thread) {
+      printf("flexfov: can't start replay worker: %s\n", SDL_GetError());
+      break;
+    }
+    SDL_DetachThread(thread);
+    started++;
+  }
+  numReplayWorkers = started;
+  if (numReplayWorkers == 0) replayWorkers = FALSE;
+}
+
+// queue the faces still to be replayed this frame, from side `from` on
+// (called once the first face is recorded, since the faces run in order)
+static void replay_workers_dispatch(u8 from) {
+  if (!replayWorkers || numReplayWorkers == 0 || numCachedVertices < REPLAY_MIN_VERTICES) return;
+
+  u8 side;
+  SDL_LockMutex(replayLock);
+  for (side=from; side<6; side++) {
+    struct ReplaySegment *s = &replaySegments[side];
+    if (!faceSchedule[side].render) continue;
+    if (s->capacity < numCachedVertices) {
+      free(s->vertices);
+      s->capacity = cachedVertexCapacity;
+      s->vertices = malloc(s->capacity * sizeof(*s->vertices));
+      if (!s->vertices) {
+        s->capacity = 0;
+        continue;
+      }
+    }
+    s->queued = TRUE;
+    s->done = FALSE;
+    s->ready = FALSE;
+    s->pending = TRUE;
+  }
+  SDL_CondBroadcast(replayWake);
+  SDL_UnlockMutex(replayLock);
+}
+
+// wait for the workers to finish the faces of this frame
+static void replay_workers_wait(void) {
+  if (numReplayWorkers == 0) return;
+  u8 side;
+  SDL_LockMutex(replayLock);
+  for (side=0; side<6; side++) {
+    struct ReplaySegment *s = &replaySegments[side];
+    while (s->pending && !s->done) SDL_CondWait(replayDone, replayLock);
+    s->pending = FALSE;
+  }
+  SDL_UnlockMutex(replayLock);
+}
+
+// copy a load out of its face's segment (FALSE if the face wasn't dispatched)
+static u8 replay_workers_fetch(u8 side, u32 first, u32 n, struct FlexFovLoadedVertex *dest) {
+  struct ReplaySegment *s = &replaySegments[side];
+  if (!s->pending) return FALSE;
+  if (!s->ready) {
+    SDL_LockMutex(replayLock);
+    while (!s->done) SDL_CondWait(replayDone, replayLock);
+    SDL_UnlockMutex(replayLock);
+    s->ready = TRUE;
+  }
+  memcpy(dest, s->vertices + first, n * sizeof(*dest));
+  return TRUE;
 }
 
 //------------------------------------------------------------------------------
 // OpenGL command hooks
 //------------------------------------------------------------------------------
 
-// create display list index markers for when each of the functions below should be called
-static Gfx *prehooksCube[6]; // cubemap framebuffer setpoints
-static Gfx *prehookQuad;     // quad projection setpoint
+// Each stage of the frame starts at a marker command in the display list
+// (see gSPFlexFovMarker), which the renderer hands to us as it reaches it:
+//   FLEXFOV_MARKER_SKY   sky panorama (also marks the start of the frame)
+//   FLEXFOV_MARKER_FACE  each cubeface rendered this frame
+//   FLEXFOV_MARKER_QUAD  quad projection
+
+static void run_cubeside(u8 i) {
+  gfx_flush();
+  bench_faces_begin();
+  profile_mark(PROFILE_FACE + i);
+  init_cubeside(i);
+  vertex_cache_begin_face(i);
+}
+
+static void run_sky(void) {
+  gfx_flush();
+  profile_begin_frame();
+  vertex_cache_begin_frame();
+  if (skyQueued) init_sky();
+  skyQueued = FALSE;
+}
+
+static void run_quad(void) {
+  gfx_flush();
+  vertex_cache_end();
+  bench_faces_end();
+  profile_mark(PROFILE_QUAD);
+  bench_quad();
+  capture_faces();
+  profile_end_frame();
+  begin_overlay();
+  if (cubemapResized) {
+    cubemapResized = FALSE;
+    log_cubemap_memory();
+  }
+}
 
-void flexfov_run_prehook(Gfx *cmd) {
-       if (cmd == prehooksCube[0]) { gfx_flush(); init_cubeside(0); }
-  else if (cmd == prehooksCube[1]) { gfx_flush(); init_cubeside(1); }
-  else if (cmd == prehooksCube[2]) { gfx_flush(); init_cubeside(2); }
-  else if (cmd == prehooksCube[3]) { gfx_flush(); init_cubeside(3); }
-  else if (cmd == prehooksCube[4]) { gfx_flush(); init_cubeside(4); }
-  else if (cmd == prehooksCube[5]) { gfx_flush(); init_cubeside(5); }
-  else if (cmd == prehookQuad)     { gfx_flush(); render_quad(); }
+// called by the renderer for each G_FLEXFOV command (see patch.diff)
+void flexfov_run_marker(u32 marker) {
+       if (marker == FLEXFOV_MARKER_SKY)  run_sky();
+  else if (marker == FLEXFOV_MARKER_QUAD) run_quad();
+  else if (marker < 6)                    run_cubeside(marker);
 }
 
 void flexfov_gfx_init(void) {
   create_cubemap();
   create_quad();
+  create_sky();
+  create_profiler();
+  glGenQueries(1, &filterQuery);
+  init_gl_shadows();
+  init_resolution_scale();
+  init_capture();
+  init_replay_workers();
+  init_frame_pacing();
+}
+
+//------------------------------------------------------------------------------
+// Display list arena (growing the game's gfx pool in chunks)
+//------------------------------------------------------------------------------
+
+// The game writes commands up from gDisplayListHead and allocates down from
+// gGfxPoolEnd, with nothing to stop the two from crossing. When the room
+// between them runs low, we branch the display list into a chunk of our own
+// and carry on there. Chunks are kept for later frames, since each frame's
+// display list has run by the time the next one is built.
+//
+// The master lists (most of each pass) reserve exactly what they emit, and the
+// rest is covered by DL_MARGIN. If the arena can't grow (out of chunks or
+// memory), the graph stops emitting while DL_FLOOR is left, instead of running
+// over, so the frame can still be closed (dropping what didn't fit).
+
+#define DL_CHUNK_SIZE (GFX_POOL_SIZE * sizeof(Gfx)) // smallest chunk (in bytes)
+#define DL_MARGIN (256 * sizeof(Gfx))              // room kept free before each graph node
+#define DL_TAIL_SIZE (DL_CHUNK_SIZE / 4)           // room left for the rest of the frame (hud, text)
+#define DL_FLOOR (32 * sizeof(Gfx))                // room never emitted into (the end of the frame, a branch)
+#define DL_MAX_CHUNKS 32
+
+static u8 *dlChunks[DL_MAX_CHUNKS];
+static u32 dlChunkSizes[DL_MAX_CHUNKS];
+static u8 dlNumChunks;
+static u8 dlNextChunk;      // next chunk to fill this frame
+static u8 *dlStart, *dlEnd; // region being filled (the game's pool or one of our chunks)
+static u32 dlSpent;         // bytes used in the regions already left this frame
+
+// high-water marks (in bytes) of each pass, and of the frame up to the quad
+// (of this level, logged to size the pool by, and of all levels, reserved)
+enum DL_PASS { DL_PASS_SKY, DL_PASS_WORLD, DL_PASS_FRAME, DL_PASSES };
+static const char *dlPassNames[DL_PASSES] = { "sky", "world", "frame" };
+static u32 dlPeak[DL_PASSES];
+static u32 dlMaxPeak[DL_PASSES];
+static u32 dlPassStart;
+static s16 dlLevel = -1; // level of the peaks
+static u32 dlOverflows;
+static u32 dlDropped; // master lists not emitted (no room)
+
+static s32 dl_room(void) {
+  return gGfxPoolEnd - (u8 *)gDisplayListHead;
+}
+
+static u32 dl_used(void) {
+  return dlSpent + ((u8 *)gDisplayListHead - dlStart) + (dlEnd - gGfxPoolEnd);
+}
+
+// follow the game to the pool of a new frame
+static void dl_sync(void) {
+  u8 *head = (u8 *)gDisplayListHead;
+  if (head >= dlStart && head <= dlEnd) return;
+  dlStart = (u8 *)gGfxPool->buffer;
+  dlEnd = dlStart + sizeof(gGfxPool->buffer);
+  dlNextChunk = 0;
+  dlSpent = 0;
+}
+
+static void dl_overflow(s32 room) {
+  dlOverflows++;
+  printf("flexfov: display list overflowed by %d bytes (%u times), DL_MARGIN is too small\n", -room, dlOverflows);
+}
+
+// branch into a chunk with at least `size` bytes free
+static u8 dl_grow(u32 size) {
+  s32 room = dl_room();
+  if (room < (s32)sizeof(Gfx)) {
+    // no room left for the branch itself
+    dl_overflow(room - sizeof(Gfx));
+    return FALSE;
+  }
+
+  u8 i = dlNextChunk;
+  if (i == dlNumChunks) {
+    if (dlNumChunks == DL_MAX_CHUNKS) {
+      printf("flexfov: display list arena is out of chunks\n");
+      return FALSE;
+    }
+    dlNumChunks++;
+  }
+
+  size = ALIGN8(size + DL_MARGIN);
+  if (dlChunkSizes[i] < size) {
+    u32 chunkSize = size > DL_CHUNK_SIZE ? size : DL_CHUNK_SIZE;
+    free(dlChunks[i]);
+    dlChunks[i] = malloc(chunkSize);
+    dlChunkSizes[i] = dlChunks[i] ? chunkSize : 0;
+    if (!dlChunks[i]) {
+      printf("flexfov: display list arena is out of memory\n");
+      return FALSE;
+    }
+  }
+
+  gSPBranchList(gDisplayListHead++, dlChunks[i]);
+  dlSpent = dl_used();
+  dlStart = dlChunks[i];
+  dlEnd = dlStart + dlChunkSizes[i];
+  gDisplayListHead = (Gfx *)dlStart;
+  gGfxPoolEnd = dlEnd;
+  dlNextChunk++;
+  return TRUE;
+}
+
+// make room for `size` bytes of commands before writing them
+// (returns whether they fit, keeping DL_FLOOR)
+static u8 dl_reserve(u32 size) {
+  dl_sync();
+  if (dl_room() >= (s32)(size + DL_MARGIN)) return TRUE;
+  return dl_grow(size) || dl_room() >= (s32)(size + DL_FLOOR);
+}
+
+// called by alloc_display_list (see patch.diff)
+// (keeping room for one more command, for a branch)
+u8 flexfov_reserve_display_list(u32 size) {
+  dl_sync();
+  if (dl_room() >= (s32)(size + sizeof(Gfx))) return TRUE;
+  return dl_grow(size);
+}
+
+// called before each graph node is processed (see patch.diff)
+// (returns FALSE to stop processing the graph, when the arena can't grow)
+u8 flexfov_check_display_list(void) {
+  dl_sync();
+  s32 room = dl_room();
+  if (room < 0) dl_overflow(room);
+  else if (room < (s32)DL_MARGIN && !dl_grow(DL_MARGIN)) return room >= (s32)DL_FLOOR;
+  return room >= 0;
+}
+
+// called by geo_process_master_list_sub before it emits (see patch.diff)
+// (returns FALSE to skip the master list, when the arena can't grow)
+u8 flexfov_reserve_master_list(struct GraphNodeMasterList *node) {
+  u32 n = 4; // (z buffer on and off)
+  u8 i;
+  for (i=0; i<GFX_NUM_MASTER_LISTS; i++) {
+    struct DisplayListNode *list = node->listHeads[i];
+    if (list) n++; // (render mode)
+    for (; list; list = list->next) n += 2; // (matrix, display list)
+  }
+  if (dl_reserve(n * sizeof(Gfx))) return TRUE;
+  dlDropped++;
+  return FALSE;
+}
+
+void log_display_list(void) {
+  printf("flexfov: display list peak of level %d:", dlLevel);
+  u8 i;
+  for (i=0; i<DL_PASSES; i++) printf(" %s=%u", dlPassNames[i], dlPeak[i]);
+  printf(" bytes (%u chunks, pool is %u bytes, %u master lists dropped)\n", dlNumChunks, (u32)DL_CHUNK_SIZE, dlDropped);
+}
+
+// reserve the room the pass needed before (so it rarely has to branch)
+static void dl_begin_pass(enum DL_PASS pass) {
+  dl_reserve(dlMaxPeak[pass]);
+  dlPassStart = dl_used();
+}
+
+static void dl_update_peak(enum DL_PASS pass, u32 used) {
+  if (used > dlPeak[pass]) dlPeak[pass] = used;
+  if (used > dlMaxPeak[pass]) dlMaxPeak[pass] = used;
+}
+
+static void dl_end_pass(enum DL_PASS pass) {
+  dl_update_peak(pass, dl_used() - dlPassStart);
+}
+
+// start the peaks over for each level (logging the last one's, to size the pool by)
+static void dl_begin_frame(void) {
+  extern s16 gCurrLevelNum;
+  if (dlLevel == gCurrLevelNum) return;
+  if (dlLevel >= 0) log_display_list();
+  dlLevel = gCurrLevelNum;
+  memset(dlPeak, 0, sizeof(dlPeak));
+  dlDropped = 0;
+}
+
+static void dl_end_frame(void) {
+  dl_sync();
+  dl_update_peak(DL_PASS_FRAME, dl_used());
+  dl_reserve(DL_TAIL_SIZE);
+}
+
+// mark the start of a stage (see flexfov_run_marker)
+// (written into DL_FLOOR if the arena can't grow, since a stage's commands without
+//  its marker would run in the previous stage; returns FALSE only when out of room)
+static u8 dl_mark(enum FLEXFOV_MARKER marker) {
+  dl_reserve(sizeof(Gfx));
+  if (dl_room() < (s32)sizeof(Gfx)) return FALSE; // (dl_grow reported it)
+  gSPFlexFovMarker(gDisplayListHead++, marker);
+  return TRUE;
 }
 
 //------------------------------------------------------------------------------
 // RDP rendering (display list additions)
 //------------------------------------------------------------------------------
 
-void flexfov_geo_process_root(struct GraphNodeRoot *root, Vp *b, Vp *c, s32 clearColor) {
+// projection of the recorded world pass (before rotating it to each cubeside)
+static Mat4 worldProjection;
+static u8 recordingWorld;
+
+u8 flexfov_defer_projection(struct GraphNodePerspective *node, f32 aspect) {
+  if (!recordingWorld) return FALSE;
+
+  // same as the guPerspective call in geo_process_perspective
+  u16 perspNorm;
+  guPerspectiveF(worldProjection, &perspNorm, node->fov, aspect, 1.0f, node->far, 1.0f);
+  return TRUE;
+}
+
+static void replay_world_pass(struct GraphNodeRoot *root, Vp *b, Vp *c, s32 clearColor) {
+  // record the world pass as a sub display list, which is skipped over
+  // so that it only runs when called by each cubeface
+  Gfx *skip = gDisplayListHead++;
+  Gfx *world = gDisplayListHead;
+  flexFovSide = FLEXFOV_CUBE_FRONT;
+  recordingWorld = TRUE;
+  geo_process_root(root, b, c, clearColor);
+  recordingWorld = FALSE;
+  gSPEndDisplayList(gDisplayListHead++);
+  gSPBranchList(skip, gDisplayListHead);
+
+  // (the traversal has set this frame's camera)
+  schedule_faces();
+  memcpy(vertexProjection, worldProjection, sizeof(Mat4));
+
+  // Camera space of each cubeface is a rotation of the front camera space,
+  // so we fold that rotation into the projection:
+  //   vertex × modelview × rotation × projection
+  u8 i;
+  for (i=0; i<6; i++) {
+    if (!faceSchedule[i].render) continue;
+
+    Mat4 rotation, projection;
+    side_rotation(rotation, i);
+    mtxf_mul(projection, rotation, worldProjection);
+    Mtx *mtx = alloc_display_list(sizeof(*mtx));
+    mtxf_to_mtx(mtx, projection);
+
+    if (!dl_mark(FLEXFOV_MARKER_FACE + i)) continue;
+    gSPMatrix(gDisplayListHead++, mtx, G_MTX_PROJECTION | G_MTX_LOAD | G_MTX_NOPUSH);
+    gSPDisplayList(gDisplayListHead++, world);
+  }
+}
+
+// background node of the area (drawn by the sky pass)
+static struct GraphNodeBackground *find_background(struct GraphNode *first, u8 depth) {
+  struct GraphNode *node = first;
+  if (node == NULL || depth == 0) return NULL;
+  do {
+    if (node->type == GRAPH_NODE_TYPE_BACKGROUND) return (struct GraphNodeBackground *)node;
+    struct GraphNodeBackground *child = find_background(node->children, depth - 1);
+    if (child) return child;
+    node = node->next;
+  } while (node != first);
+  return NULL;
+}
+
+// the background that the sky panorama was rendered from
+static struct GraphNodeBackground *skyNode;
+static GraphNodeFunc skyFunc;
+static s32 skyBackground;
+static u8 skyRendered;
+
+static u8 sky_changed(struct GraphNodeRoot *root) {
+  struct GraphNodeBackground *node = find_background(root->node.children, 4);
+  GraphNodeFunc func = node ? node->fnNode.func : NULL;
+  s32 background = node ? node->background : 0;
+  if (skyRendered && node == skyNode && func == skyFunc && background == skyBackground) return FALSE;
+  skyNode = node;
+  skyFunc = func;
+  skyBackground = background;
+  skyRendered = TRUE;
+  return TRUE;
+}
+
+static void build_root(struct GraphNodeRoot *root, Vp *b, Vp *c, s32 clearColor) {
   if (!flexfov_is_on()) {
+    scheduleValid = FALSE;
     geo_process_root(root, b, c, clearColor);
     return;
   }
 
   u8 i;
-  flexFovSky = TRUE;
-  geo_process_root(root, b, c, clearColor);
-  flexFovSky = FALSE;
-  // TODO: save front cubeface up vector (gCurGraphNodeCamera->matrixPtr?) to lock the sphereboard y-axis
-  for (i=0; i<6; i++) {
-    flexFovSide = i;
-    prehooksCube[i] = gDisplayListHead;
+  for (i=0; i<6; i++) culledObjects[i] = 0;
+  culledFar = 0;
+  begin_transform_cache();
+  memcpy(prevCamBasis, camBasis, sizeof(camBasis));
+
+  // skip the cubefaces that our projection doesn’t sample
+  // (and size the rest by how much of the screen they cover)
+  update_face_usage();
+  update_face_sizes();
+
+  // redraw the sky panorama only when the background changes
+  dl_begin_frame();
+  dl_begin_pass(DL_PASS_SKY);
+  if (dl_mark(FLEXFOV_MARKER_SKY) && sky_changed(root)) {
+    skyQueued = TRUE;
+    flexFovSky = TRUE;
     geo_process_root(root, b, c, clearColor);
+    flexFovSky = FALSE;
+  }
+  dl_end_pass(DL_PASS_SKY);
+  if (replayFaces) {
+    dl_begin_pass(DL_PASS_WORLD);
+    replay_world_pass(root, b, c, clearColor);
+    dl_end_pass(DL_PASS_WORLD);
+  } else {
+    // (scheduled from the previous frame's camera, which the traversals only set as they go)
+    schedule_faces();
+    // TODO: save front cubeface up vector (gCurGraphNodeCamera->matrixPtr?) to lock the sphereboard y-axis
+    for (i=0; i<6; i++) {
+      if (!faceSchedule[i].render) continue;
+      flexFovSide = i;
+      dl_begin_pass(DL_PASS_WORLD);
+      if (dl_mark(FLEXFOV_MARKER_FACE + i)) geo_process_root(root, b, c, clearColor);
+      dl_end_pass(DL_PASS_WORLD);
+    }
   }
-  prehookQuad = gDisplayListHead;
+  stamp_faces(far);
+  dl_mark(FLEXFOV_MARKER_QUAD);
+  dl_end_frame();
+}
+
+void flexfov_geo_process_root(struct GraphNodeRoot *root, Vp *b, Vp *c, s32 clearColor) {
+  bench_next_frame();
+  Uint64 start = SDL_GetPerformanceCounter();
+  build_root(root, b, c, clearColor);
+  if (benchOut) benchTimes[BENCH_GEO] = bench_ms(start, SDL_GetPerformanceCounter());
 }
 
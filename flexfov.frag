@@ -1,5 +1,8 @@
 #version 110
 
+// explicit gradients for filtering the cubefaces (see textureSideGrad)
+#extension GL_ARB_shader_texture_lod : enable
+
 // This is a shader that draws the wide angle projection
 // and the extra UI elements for controlling it.
 
@@ -24,15 +27,15 @@ varying vec2 vUV;
 //  *--------|---------------------------|--------*  v=-3/4
 //            <------- desired fov ----->
 
-uniform float pixelSize;
-
-// Environment map
-uniform samplerCube cubeTexture;
+// Environment map (one texture per cubeface, see FLEXFOV_CUBE_SIDE)
+uniform sampler2D faceTextures[6];
 
-// Toggles
-uniform bool useRubix;    // show rubix grid overlay
-uniform bool useCube;     // use cubenet projection
-uniform bool controlsOn;  // controls are enabled (show normal fov box for reference)
+// Toggles (each combination is its own program, see QUAD_VARIANTS in flexfov.c)
+//   USE_RUBIX     show rubix grid overlay
+//   CONTROLS_ON   controls are enabled (show normal fov box for reference)
+//   SHOW_PROFILE  show the time of each stage (see PROFILE_STAGES in flexfov.c)
+//   FILTER_MODE   how the cubefaces are filtered (see FLEXFOV_FILTER in flexfov.c)
+//   PROJECTION    projection of the ray pass (see RAY_VARIANTS in flexfov.c)
 uniform bool zooming;     // z-trig held (currently changing `mobiusZoom`)
 
 // Knobs
@@ -296,6 +299,49 @@ bool on_zoom_overlay(vec2 uv) {
   return false;
 }
 
+// Profiler bars (one row per stage, CPU on top and GPU below)
+uniform float profileCpu[8];  // ms of each stage: sky, six cubefaces, quad
+uniform float profileGpu[8];
+uniform float profileBudget;  // ms of a frame (at the end of the bars)
+
+vec4 stage_color(int stage) {
+  if (stage == 0) return green;                   // sky
+  if (stage == 1) return white;                   // front
+  if (stage == 2) return blue;                    // left
+  if (stage == 3) return red;                     // right
+  if (stage == 4) return vec4(0.3, 0.3, 0.3, 1.0); // back
+  if (stage == 5) return magenta;                 // up
+  if (stage == 6) return cyan;                    // down
+  return yellow;                                  // quad
+}
+
+vec4 profile_overlay(vec2 uv) {
+  float x0 = 0.25;
+  float width = 0.4;
+  float top = 0.2;
+  float rowH = 0.04;
+  float thick = 0.0125/2.0;
+
+  if (uv.x < x0 || uv.x > x0 + width + thick) return clear;
+  float rows = (top - uv.y) / rowH;
+  if (rows < 0.0 || rows >= 8.0) return clear;
+
+  // budget line
+  if (uv.x > x0 + width) return black;
+
+  int stage = int(floor(rows));
+  float y = rows - floor(rows);
+  if (y < 0.1 || y > 0.9) return clear;
+
+  float ms = 0.0;
+  for (int i=0; i<8; i++) {
+    if (i == stage) ms = y < 0.5 ? profileCpu[i] : profileGpu[i];
+  }
+  if (uv.x - x0 > ms / profileBudget * width) return vec4(0.0, 0.0, 0.0, 0.5);
+  vec4 color = stage_color(stage);
+  return y < 0.5 ? mix(color, black, 0.4) : color;
+}
+
 vec4 zoom_overlay(vec2 uv) {
   float thick = 0.0125/2.0;
   vec2 shadowUV = uv + vec2(-thick, thick);
@@ -311,62 +357,220 @@ vec4 zoom_overlay(vec2 uv) {
 // Cube lookup
 //------------------------------------------------------------------------------
 
-// cubemap texture lookup vector
-// (accounting for upside-down textures)
-vec3 cuberay(vec3 ray) {
+bool is_up_or_down(vec3 ray) {
+  float ax = abs(ray.x);
+  float ay = abs(ray.y);
+  float az = abs(ray.z);
+  return ay >= ax && ay >= az;
+}
+
+// flip a ray like `cuberay` would for a ray on an up/down face (or not)
+vec3 flipray(vec3 ray, bool upOrDownFace) {
   float x = ray.x;
   float y = ray.y;
   float z = ray.z;
-  float ax = abs(x);
-  float ay = abs(y);
-  float az = abs(z);
-  bool upOrDownFace = ay >= ax && ay >= az;
   return upOrDownFace ? vec3(x,y,-z) : vec3(x,-y,z);
 }
 
-// lookup color in cubemap
-// (accounting for colored overlays)
-vec4 cubecolor(vec3 ray) {
-  // translucent black if blank ray
-  vec4 color;
+// cubemap texture lookup vector
+// (accounting for upside-down textures)
+vec3 cuberay(vec3 ray) {
+  return flipray(ray, is_up_or_down(ray));
+}
+
+// part of a cubeface's width taken by its 90° square, the rest is the gutter rendered
+// past its edges for filtering (FLEXFOV_FACE_SCALE in flexfov_proj.h)
+const float faceSquare = 1.0 / (1.0 + 1.0/16.0);
 
-  if (blankRay == ray) {
-    color = vec4(0.0, 0.0, 0.0, 0.5);
+// texture coords of a cubemap lookup vector on the given cubeface
+// (past the 90° square into the gutter, or past 0 to 1, if the vector is on a neighboring face)
+vec2 side_st(int side, vec3 r) {
+  float sc, tc, ma;
+  if (side == 4 || side == 5) {
+    sc = r.x; tc = side == 4 ? r.z : -r.z; ma = abs(r.y);
+  } else if (side == 1 || side == 2) {
+    sc = side == 2 ? -r.z : r.z; tc = -r.y; ma = abs(r.x);
   } else {
+    sc = side == 0 ? r.x : -r.x; tc = -r.y; ma = abs(r.z);
+  }
+  return (vec2(sc, tc)/ma * faceSquare + 1.0) * 0.5;
+}
+
+// select the cubeface and its texture coords for a cubemap lookup vector
+// (see “Cube Map Texture Selection” in the OpenGL spec)
+int cubeside(vec3 r, out vec2 st) {
+  float ax = abs(r.x);
+  float ay = abs(r.y);
+  float az = abs(r.z);
+  int side;
+  if (ay >= ax && ay >= az) {
+    side = r.y > 0.0 ? 4 : 5; // up or down
+  } else if (ax >= az) {
+    side = r.x > 0.0 ? 2 : 1; // right or left
+  } else {
+    side = r.z > 0.0 ? 0 : 3; // front or back
+  }
+  st = side_st(side, r);
+  return side;
+}
+
+// like textureCube, but our cubefaces are separate textures
+// (so that each can have its own size)
+vec4 textureCubefaces(vec3 r) {
+  vec2 st;
+  int side = cubeside(r, st);
+  if (side == 0) return texture2D(faceTextures[0], st);
+  if (side == 1) return texture2D(faceTextures[1], st);
+  if (side == 2) return texture2D(faceTextures[2], st);
+  if (side == 3) return texture2D(faceTextures[3], st);
+  if (side == 4) return texture2D(faceTextures[4], st);
+  return texture2D(faceTextures[5], st);
+}
+
+// sample a cubeface with the given screen-space gradients of its texture coords
+// (the cubeface is picked by branching, where implicit derivatives are undefined)
+vec4 textureSideGrad(int side, vec2 st, vec2 dx, vec2 dy) {
+#ifdef GL_ARB_shader_texture_lod
+  if (side == 0) return texture2DGradARB(faceTextures[0], st, dx, dy);
+  if (side == 1) return texture2DGradARB(faceTextures[1], st, dx, dy);
+  if (side == 2) return texture2DGradARB(faceTextures[2], st, dx, dy);
+  if (side == 3) return texture2DGradARB(faceTextures[3], st, dx, dy);
+  if (side == 4) return texture2DGradARB(faceTextures[4], st, dx, dy);
+  return texture2DGradARB(faceTextures[5], st, dx, dy);
+#else
+  if (side == 0) return texture2D(faceTextures[0], st);
+  if (side == 1) return texture2D(faceTextures[1], st);
+  if (side == 2) return texture2D(faceTextures[2], st);
+  if (side == 3) return texture2D(faceTextures[3], st);
+  if (side == 4) return texture2D(faceTextures[4], st);
+  return texture2D(faceTextures[5], st);
+#endif
+}
+
+// Skipped cubefaces keep the image (and depth) of their last render,
+// which was seen from an older camera (see FaceSchedule in flexfov.c).
+uniform sampler2D faceDepths[6];
+uniform float faceAges[6];      // frames since each cubeface was rendered (0 = this frame)
+uniform mat3 faceRotations[6];  // current camera space to the camera space of that render
+uniform vec3 faceOrigins[6];    // current camera position in the camera space of that render
+uniform float faceFars[6];      // far plane of that render (the near plane is always 1)
+
+// depth at texture coords of a cubeface (0 to 1, like gl_FragCoord.z)
+float textureSideDepth(int side, vec2 st) {
+  if (side == 0) return texture2D(faceDepths[0], st).r;
+  if (side == 1) return texture2D(faceDepths[1], st).r;
+  if (side == 2) return texture2D(faceDepths[2], st).r;
+  if (side == 3) return texture2D(faceDepths[3], st).r;
+  if (side == 4) return texture2D(faceDepths[4], st).r;
+  return texture2D(faceDepths[5], st).r;
+}
+
+// cubeface that a ray falls on
+int rayside(vec3 ray) {
+  vec2 st;
+  return cubeside(cuberay(ray), st);
+}
+
+// Move a ray on a skipped cubeface into the camera space that the face was rendered in.
+// Turning the ray with the camera is enough for distant things, but the camera has
+// also moved, so we find the depth along the turned ray and look up the point at
+// that distance along our own ray instead.
+vec3 reproject(int side, vec3 ray) {
+  if (faceAges[side] == 0.0) return ray;
+  mat3 rotation = faceRotations[side];
+  vec3 origin = faceOrigins[side];
+  float farPlane = faceFars[side];
+
+  // distance to the surface along the turned ray, from the depth of this same face
+  // (whose rotation and origin these are, even if the turned ray has crossed to a
+  // neighbor, so its coords are clamped to the edge)
+  vec3 turned = rotation * ray;
+  vec3 r = flipray(turned, side == 4 || side == 5);
+  float ma = side == 4 || side == 5 ? abs(r.y) : side == 1 || side == 2 ? abs(r.x) : abs(r.z);
+  ma = max(ma, 0.5 * max(abs(r.x), max(abs(r.y), abs(r.z)))); // (far past the edge)
+  float z = 2.0 * textureSideDepth(side, clamp(side_st(side, r), 0.0, 1.0)) - 1.0;
+  float depth = 2.0 * farPlane / (farPlane + 1.0 - z * (farPlane - 1.0));
+  vec3 surface = turned / ma * depth;
+  float dist = length((surface - origin) * rotation); // (transposed rotation, i.e. back to current camera space)
+
+  return rotation * (normalize(ray) * dist) + origin;
+}
+
+// translucent black where the projection has no ray
+vec4 blankColor = vec4(0.0, 0.0, 0.0, 0.5);
+
+// Sky panorama (the skybox strip, rendered once per area by flexfov.c)
+uniform sampler2D skyTexture;
+uniform mat3 skyBasis; // camera space to world space
+
+// Look up the sky by the yaw and pitch of a ray, the same way the game
+// scrolls its skybox at 90° fov (see calculate_skybox_scaled_x/y in skybox.c):
+// 1280 units around, and 4 units per degree of pitch with the horizon 480 units up.
+vec4 skycolor(vec3 ray) {
+  vec3 d = skyBasis * ray;
+  float yaw = atan(d.x, d.z);
+  float pitch = atan(d.y, length(d.xz));
+  float s = (1440.0 - 1280.0 * yaw / (2.0*pi)) / 1280.0;
+  float t = (480.0 + 4.0 * degrees(pitch)) / 960.0;
+  return texture2D(skyTexture, vec2(s, t));
+}
+
+// composite a cubeface color over the sky behind it
+// (the cubefaces are cleared to transparent, and their colors are premultiplied)
+vec4 oversky(vec4 color, vec3 ray) {
+  return color + skycolor(ray) * (1.0 - color.a);
+}
+
+// add colored overlays for a ray
+vec4 rayoverlay(vec4 color, vec3 ray) {
+  // add rubix overlay
+#ifdef USE_RUBIX
+  vec4 rubixColor = rubix(ray);
+  if (rubixColor != clear) {
+    color = mix(color, rubixColor, 0.3);
+  }
+#endif
 
-    // get cube color
-    color = textureCube(cubeTexture, cuberay(ray));
+  // add normal fov border
+#ifdef CONTROLS_ON
+  if (on_normal_fov_border(ray)) {
+    color = mix(color, white, 0.5);
+  }
+#endif
 
-    // add rubix overlay
-    if (useRubix) {
-      vec4 rubixColor = rubix(ray);
-      if (rubixColor != clear) {
-        color = mix(color, rubixColor, 0.3);
-      }
-    }
+  return color;
+}
 
-    // add normal fov border
-    if (controlsOn && on_normal_fov_border(ray)) {
-      color = mix(color, white, 0.5);
-    }
+// lookup color in cubemap
+// (accounting for colored overlays)
+vec4 cubecolor(vec3 ray) {
+  vec3 r = reproject(rayside(ray), ray);
+  return rayoverlay(oversky(textureCubefaces(cuberay(r)), ray), ray);
+}
 
+// add control overlays
+// (these are drawn in screen space, so they are added after supersampling)
+vec4 overlaycolor(vec4 color) {
+#ifdef SHOW_PROFILE
+  vec4 profileColor = profile_overlay(vUV);
+  if (profileColor != clear) {
+    color = mix(color, profileColor, 0.7);
   }
+#endif
 
-  // control overlays
-  if (controlsOn) {
-
-    vec4 fovColor = fov_overlay(vUV);
-    if (fovColor != clear) {
-      color = mix(color, fovColor, zooming ? 0.2 : 0.7);
-    }
+#ifdef CONTROLS_ON
+  vec4 fovColor = fov_overlay(vUV);
+  if (fovColor != clear) {
+    color = mix(color, fovColor, zooming ? 0.2 : 0.7);
+  }
 
-    if (fov > 180.0) {
-      vec4 zoomColor = zoom_overlay(vUV);
-      if (zoomColor != clear) {
-        color = mix(color, zoomColor, zooming ? 0.7 : 0.2);
-      }
+  if (fov > 180.0) {
+    vec4 zoomColor = zoom_overlay(vUV);
+    if (zoomColor != clear) {
+      color = mix(color, zoomColor, zooming ? 0.7 : 0.2);
     }
   }
+#endif
 
   return color;
 }
@@ -576,43 +780,155 @@ vec3 cubenet(vec2 uv) {
 // Main
 //------------------------------------------------------------------------------
 
-vec4 uv_color(vec2 uv) {
-  vec3 ray;
-  if (useCube)           { ray = cubenet(uv); }
-  //else if (fov <= 180.0) { ray = flex(uv); }
-  else if (fov < 360.0)  { ray = mercator(uv); }
-  else if (fov == 360.0) { ray = equirect(uv); }
-  return cubecolor(ray);
+// (picked by flexfov.c: cubenet when useCube, else mercator below 360° and equirect at 360°)
+#define PROJECTION_CUBENET 0
+#define PROJECTION_MERCATOR 1
+#define PROJECTION_EQUIRECT 2
+#ifndef PROJECTION
+#define PROJECTION PROJECTION_MERCATOR // (the quad pass doesn't use it)
+#endif
+
+vec3 uv_to_ray(vec2 uv) {
+#if PROJECTION == PROJECTION_CUBENET
+  return cubenet(uv);
+#elif PROJECTION == PROJECTION_EQUIRECT
+  return equirect(uv);
+#else
+  //if (fov <= 180.0) return flex(uv);
+  return mercator(uv);
+#endif
+}
+
+#ifdef OVERLAY_PASS
+
+// The HUD of a game tick, drawn into its own texture in fast view so that it
+// can be laid over the projection again between ticks (see Fast view in flexfov.c).
+uniform sampler2D overlayTexture; // premultiplied
+uniform vec2 screenSize;
+
+void main(void)
+{
+  gl_FragColor = texture2D(overlayTexture, gl_FragCoord.xy / screenSize);
 }
 
-vec4 uv_color_ss(vec2 uv) {
-  float e = pixelSize;
+#elif defined(RAY_PASS)
+
+// The rays only change with the knobs and the window size,
+// so this pass writes them to a texture that is reused until they change.
+//
+// Blank rays are stored as zero and the rest as (ray, 1), so filtering
+// between neighboring texels keeps the direction of the ray (w = coverage).
+void main(void)
+{
+  vec3 ray = uv_to_ray(vUV);
+  gl_FragColor = ray == blankRay ? vec4(0.0) : vec4(ray, 1.0);
+}
+
+#else
+
+uniform sampler2D rayTexture; // written by the ray pass (same size as the screen)
+uniform vec2 screenSize;
+uniform mat3 viewRotation;    // displayed camera space to the camera space of the cubefaces (see Fast view in flexfov.c)
 
-  vec2 l = uv + vec2(0,e);
-  vec2 r = uv + vec2(0,-e);
-  vec2 u = uv + vec2(e,0);
-  vec2 d = uv + vec2(-e,0);
+uniform float faceSizes[6]; // texels across each cubeface
 
-  vec2 tl = uv + vec2(-e,e);
-  vec2 tr = uv + vec2(e,e);
-  vec2 bl = uv + vec2(-e,-e);
-  vec2 br = uv + vec2(e,-e);
+#ifndef FILTER_MODE
+#define FILTER_MODE 2 // (FLEXFOV_FILTER_ANISOTROPIC, the default)
+#endif
 
+// ray at an offset from the pixel center (in pixels)
+// (xyz scaled by its coverage in w, see RAY_PASS)
+vec4 ray_at(vec2 offset) {
+  vec4 r = texture2D(rayTexture, (gl_FragCoord.xy + offset) / screenSize);
+  return vec4(viewRotation * r.xyz, r.w);
+}
+
+// color of the ray at an offset from the pixel center (in pixels)
+vec4 ray_color(vec2 offset) {
+  vec4 r = ray_at(offset);
+  if (r.w == 0.0) return blankColor;
+  return mix(blankColor, cubecolor(r.xyz), r.w);
+}
+
+// FLEXFOV_FILTER_SS9
+// 3x3 taps a quarter pixel apart
+// (the ray texture is linearly filtered, so the taps between texels are interpolated rays)
+vec4 ray_color_ss() {
+  float e = 0.25;
   return (
-    uv_color(uv) +
-    uv_color(l) +
-    uv_color(r) +
-    uv_color(u) +
-    uv_color(d) +
-    uv_color(tl) +
-    uv_color(tr) +
-    uv_color(bl) +
-    uv_color(br)
+    ray_color(vec2(0,0)) +
+    ray_color(vec2(0,e)) +
+    ray_color(vec2(0,-e)) +
+    ray_color(vec2(e,0)) +
+    ray_color(vec2(-e,0)) +
+    ray_color(vec2(-e,e)) +
+    ray_color(vec2(e,e)) +
+    ray_color(vec2(-e,-e)) +
+    ray_color(vec2(e,-e))
   ) / 9.0;
 }
 
+// Texture coords of the pixel on its cubeface, and their change across the pixel.
+// (rays half a pixel to each side are on the same face, or just past its edge)
+// (on a skipped face, all of these rays are reprojected the same way)
+int pixel_st(vec3 ray, out vec2 st, out vec2 dx, out vec2 dy) {
+  int rendered = rayside(ray);
+  ray = reproject(rendered, ray);
+  bool upOrDown = is_up_or_down(ray);
+  int side = cubeside(flipray(ray, upOrDown), st);
+  vec4 l = ray_at(vec2(-0.5,0));
+  vec4 r = ray_at(vec2(0.5,0));
+  vec4 b = ray_at(vec2(0,-0.5));
+  vec4 t = ray_at(vec2(0,0.5));
+  dx = l.w == 0.0 || r.w == 0.0 ? vec2(0.0) :
+    side_st(side, flipray(reproject(rendered, r.xyz), upOrDown)) - side_st(side, flipray(reproject(rendered, l.xyz), upOrDown));
+  dy = b.w == 0.0 || t.w == 0.0 ? vec2(0.0) :
+    side_st(side, flipray(reproject(rendered, t.xyz), upOrDown)) - side_st(side, flipray(reproject(rendered, b.xyz), upOrDown));
+  return side;
+}
+
+// FLEXFOV_FILTER_TRILINEAR and FLEXFOV_FILTER_ANISOTROPIC
+// one mipmapped tap sized to the pixel footprint
+// (the two differ only by the anisotropy of the cubeface textures)
+vec4 ray_color_mip() {
+  vec4 r = ray_at(vec2(0,0));
+  if (r.w == 0.0) return blankColor;
+  vec2 st, dx, dy;
+  int side = pixel_st(r.xyz, st, dx, dy);
+  vec4 color = rayoverlay(oversky(textureSideGrad(side, st, dx, dy), r.xyz), r.xyz);
+  return mix(blankColor, color, r.w);
+}
+
+// FLEXFOV_FILTER_ADAPTIVE
+// one tap where the cubeface is magnified, up to 3x3 where it is squeezed
+vec4 ray_color_adaptive() {
+  vec4 r = ray_at(vec2(0,0));
+  if (r.w == 0.0) return blankColor;
+  vec2 st, dx, dy;
+  int side = pixel_st(r.xyz, st, dx, dy);
+  vec2 texels = vec2(length(dx), length(dy)) * faceSizes[side];
+  vec2 taps = clamp(ceil(texels), 1.0, 3.0);
+  if (taps.x == 1.0 && taps.y == 1.0) return mix(blankColor, cubecolor(r.xyz), r.w);
+
+  vec4 sum = vec4(0.0);
+  for (float i=0.0; i<taps.x; i++) {
+    for (float j=0.0; j<taps.y; j++) {
+      sum += ray_color((vec2(i,j) + 0.5) / taps - 0.5);
+    }
+  }
+  return sum / (taps.x * taps.y);
+}
+
 void main(void)
 {
-  gl_FragColor = uv_color_ss(vUV);
+#if FILTER_MODE == 0
+  vec4 color = ray_color_ss();
+#elif FILTER_MODE == 3
+  vec4 color = ray_color_adaptive();
+#else
+  vec4 color = ray_color_mip();
+#endif
+  gl_FragColor = overlaycolor(color);
 }
 
+#endif
@@ -4,21 +4,64 @@
 #include "include/types.h" // import Vec4f, Vec3f, Mat4
 
 #include "include/PR/gbi.h" // import Vp, Light_t
-#include "src/engine/graph_node.h" // import GraphNodeRoot, Gfx, GraphNodePerspective
+#include "src/engine/graph_node.h" // import GraphNodeRoot, Gfx, GraphNodePerspective, GraphNodeMasterList
 
 extern u8 flexFovSky;
 
+// same layout as LoadedVertex in gfx_pc.c (checked there, see patch.diff)
+struct FlexFovLoadedVertex {
+  float x, y, z, w;
+  float u, v;
+  struct { u8 r, g, b, a; } color;
+  u8 clip_rej;
+};
+
+// animation state that geo_process_animated_part advances for each part
+// (restored when a part is reused from the transform cache, see flexfov.c)
+struct FlexFovAnimState {
+  u16 *attribute;
+  s32 type;
+};
+
+// Marker of the start of a stage in the display list, run by the renderer (see flexfov_run_marker).
+// Its opcode is unused by both the RSP and the RDP, so it can't be mistaken for a real command.
+#define G_FLEXFOV 0xc1
+enum FLEXFOV_MARKER {
+  FLEXFOV_MARKER_FACE, // (plus the side of the face, see FLEXFOV_CUBE_SIDE)
+  FLEXFOV_MARKER_SKY = 6,
+  FLEXFOV_MARKER_QUAD
+};
+#define gSPFlexFovMarker(pkt, marker) \
+{ \
+  Gfx *_g = (Gfx *)(pkt); \
+  _g->words.w0 = _SHIFTL(G_FLEXFOV, 24, 8) | _SHIFTL(marker, 0, 24); \
+  _g->words.w1 = 0; \
+}
+
 u8 flexfov_is_on(void);
+f32 flexfov_face_fov(void);
 void flexfov_set_cam(Vec4f *m);
-void flexfov_run_prehook(Gfx *cmd);
+void flexfov_run_marker(u32 marker);
 void flexfov_gfx_init(void);
 void flexfov_geo_process_root(struct GraphNodeRoot *root, Vp *b, Vp *c, s32 clearColor);
-void flexfov_resize_cubemap(void);
 void flexfov_set_light_direction(Light_t *light);
-void flexfov_set_fog_scale(float m[4][4], float v[3], float *z, float *w);
+void flexfov_set_fog_batch(float m[4][4], const Vtx *vertices, u32 n);
+void flexfov_set_fog_scale(u32 i, float *z, float *w);
 void flexfov_set_fog_planes(struct GraphNodePerspective *node);
+u8 flexfov_defer_projection(struct GraphNodePerspective *node, f32 aspect);
 void flexfov_update_input(void);
-void flexfov_mtxf_cylboard(Mat4 dest, Mat4 src, Vec3f pos, Vec3f cam);
-void flexfov_mtxf_ballboard(Mat4 dest, Mat4 src, Vec3f pos);
+void flexfov_mtxf_cylboard(const void *node, Mat4 dest, Mat4 src, Vec3f pos, Vec3f cam);
+void flexfov_mtxf_ballboard(const void *node, Mat4 dest, Mat4 src, Vec3f pos);
+u8 flexfov_cached_anim_part(const void *node, Mat4 matrix, struct FlexFovAnimState *anim);
+void flexfov_cache_anim_part(const void *node, Mat4 matrix, const struct FlexFovAnimState *anim);
+s32 flexfov_obj_is_in_view(struct GraphNodeObject *node, Mat4 matrix);
+void flexfov_count_vertices(u32 n);
+void flexfov_count_flush(u32 triangles);
+u8 flexfov_replay_vertices(const Vtx *src, u32 n, struct FlexFovLoadedVertex *dest, float m[4][4], float aspectX);
+u8 flexfov_reserve_display_list(u32 size);
+u8 flexfov_check_display_list(void);
+u8 flexfov_reserve_master_list(struct GraphNodeMasterList *node);
+void flexfov_end_frame(void);
+void flexfov_present_view_frames(void);
 
 #endif // _FLEXFOV_H
@@ -0,0 +1,382 @@
+// Microbenchmark of the CPU projection stack (see flexfov_remap.h).
+//
+//   make bench
+//   ./flexfov_bench [-w width] [-h height] [-t threads] [-n frames] [-o frame.ppm]
+//   ./flexfov_bench -g path
+//
+// For each projection and fov, this reports the rate (in Mpixels/s) of
+//   * rays:  evaluating the projection for every pixel (the ray pass)
+//   * remap: looking up a cube image along those rays (the quad pass)
+// on one thread and on `threads` threads.
+//
+// It then reports the rate (in Mvertices/s) of the fog depths of vertex loads
+// (see flexfov_fog.h), one vertex at a time and batched.
+//
+// `-o` writes the frame of the last configuration, remapped from a cube
+// colored like the rubix overlay, for comparing against a screenshot of the shader.
+//
+// `-g` checks the CPU mirror against a golden frame of the shader, written by the
+// game (FLEXFOV_BENCH_GOLDEN, see bench.sh). The rays must match the ray pass, and
+// each pixel of the projection must lie between the texels around the one that the
+// CPU looks up along the shader's ray (its filter blends them). Exits with 1 if not.
+
+#include "flexfov_remap.h"
+#include "flexfov_fog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Config {
+  const char *name;
+  struct FlexFovKnobs knobs;
+};
+
+// mobius zoom is the default for each fov (see getMobiusZoom)
+static const struct Config configs[] = {
+  { "mercator 120",          { 120.0f, 0.0f, -1.0f,    0 } },
+  { "mercator 180",          { 180.0f, 0.0f, -1.0f,    0 } },
+  { "mercator 240",          { 240.0f, 0.0f, -0.6667f, 0 } },
+  { "mercator 240 pitched",  { 240.0f, 0.5f, -0.6667f, 0 } },
+  { "mercator 300",          { 300.0f, 0.0f, -0.3333f, 0 } },
+  { "equirect 360",          { 360.0f, 0.0f,  0.0f,    0 } },
+  { "equirect 360 zoomed",   { 360.0f, 0.5f,  0.5f,    0 } },
+  { "cubenet",               { 180.0f, 0.0f, -1.0f,    1 } },
+};
+#define NUM_CONFIGS (sizeof(configs)/sizeof(configs[0]))
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// faces colored like the rubix overlay in flexfov.frag, with a grid to show distortion
+#define FACE_SIZE 1024
+static unsigned int *make_face(int side) {
+  static const unsigned int colors[6] = {
+    0xffffffff, // front (white)
+    0xffff0000, // left (blue)
+    0xff0000ff, // right (red)
+    0xff000000, // back (black)
+    0xffff00ff, // up (magenta)
+    0xffffff00, // down (cyan)
+  };
+  unsigned int *face = malloc(FACE_SIZE * FACE_SIZE * sizeof(*face));
+  int x, y;
+  for (y=0; y<FACE_SIZE; y++) {
+    for (x=0; x<FACE_SIZE; x++) {
+      int onGrid = (x % (FACE_SIZE/10)) < 4 || (y % (FACE_SIZE/10)) < 4;
+      face[y*FACE_SIZE + x] = onGrid ? 0xff808080 : colors[side];
+    }
+  }
+  return face;
+}
+
+static void write_ppm(const char *path, const unsigned int *pixels, int w, int h) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", w, h);
+  int i;
+  for (i=0; i<w*h; i++) {
+    unsigned char rgba[4];
+    memcpy(rgba, &pixels[i], 4);
+    fwrite(rgba, 1, 3, f);
+  }
+  fclose(f);
+}
+
+//------------------------------------------------------------------------------
+// Golden frame comparison
+//------------------------------------------------------------------------------
+
+#define GOLDEN_MAX_ANGLE 1e-3 // radians between the shader's ray and ours
+#define GOLDEN_MAX_BLANK 0.005 // share of pixels blank on one side only (at the edges)
+#define GOLDEN_MIN_COLORS 0.99 // share of pixels within the texels around ours
+#define GOLDEN_TEXELS 2        // texels around ours (the SS9 taps are about a pixel apart)
+#define GOLDEN_TOLERANCE 2     // (rounding of the blend)
+
+// read a binary PPM into RGBA pixels (like the faces of FlexFovCube)
+static unsigned int *read_ppm(const char *path, int *w, int *h) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+  int max;
+  unsigned int *pixels = NULL;
+  if (fscanf(f, "P6 %d %d %d", w, h, &max) == 3 && fgetc(f) != EOF && *w > 0 && *h > 0 && max == 255) {
+    pixels = malloc((size_t)*w * *h * sizeof(*pixels));
+    int i;
+    for (i=0; pixels && i < *w * *h; i++) {
+      unsigned char rgb[3];
+      if (fread(rgb, 1, 3, f) != 3) { free(pixels); pixels = NULL; break; }
+      pixels[i] = rgb[0] | rgb[1] << 8 | rgb[2] << 16 | 0xffu << 24;
+    }
+  }
+  fclose(f);
+  return pixels;
+}
+
+// read a little-endian RGB PFM (rows from bottom to top)
+static float *read_pfm(const char *path, int *w, int *h) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+  float scale;
+  float *data = NULL;
+  if (fscanf(f, "PF %d %d %f", w, h, &scale) == 3 && fgetc(f) != EOF && *w > 0 && *h > 0 && scale < 0.0f) {
+    size_t n = (size_t)*w * *h * 3;
+    data = malloc(n * sizeof(float));
+    if (data && fread(data, sizeof(float), n, f) != n) { free(data); data = NULL; }
+  }
+  fclose(f);
+  return data;
+}
+
+// whether a color is within the texels around (s, t) of a cubeface, channel by channel
+static int within_texels(const struct FlexFovCube *cube, int side, float s, float t, unsigned int color) {
+  int size = cube->sizes[side];
+  int x0 = (int)(s * size), y0 = (int)(t * size);
+  int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+  int x, y, c;
+  for (y = y0-GOLDEN_TEXELS; y <= y0+GOLDEN_TEXELS; y++) {
+    for (x = x0-GOLDEN_TEXELS; x <= x0+GOLDEN_TEXELS; x++) {
+      int cx = x < 0 ? 0 : x >= size ? size-1 : x;
+      int cy = y < 0 ? 0 : y >= size ? size-1 : y;
+      unsigned int texel = cube->faces[side][cy*size + cx];
+      for (c=0; c<3; c++) {
+        int v = (texel >> (8*c)) & 0xff;
+        if (v < lo[c]) lo[c] = v;
+        if (v > hi[c]) hi[c] = v;
+      }
+    }
+  }
+  for (c=0; c<3; c++) {
+    int v = (color >> (8*c)) & 0xff;
+    if (v < lo[c] - GOLDEN_TOLERANCE || v > hi[c] + GOLDEN_TOLERANCE) return 0;
+  }
+  return 1;
+}
+
+static int compare_golden(const char *base, int threads) {
+  char path[1024];
+  struct FlexFovKnobs knobs;
+  snprintf(path, sizeof(path), "%s.txt", base);
+  FILE *f = fopen(path, "r");
+  if (!f || fscanf(f, "%f %f %f %d", &knobs.fov, &knobs.camPitch, &knobs.mobiusZoom, &knobs.useCube) != 4) {
+    fprintf(stderr, "%s: can't read the knobs\n", path);
+    return 1;
+  }
+  fclose(f);
+
+  int w, h, fw, fh, i;
+  snprintf(path, sizeof(path), "%s.rays.pfm", base);
+  float *shaderRays = read_pfm(path, &w, &h);
+  snprintf(path, sizeof(path), "%s.ppm", base);
+  unsigned int *frame = read_ppm(path, &fw, &fh);
+  if (!shaderRays || !frame || fw != w || fh != h) {
+    fprintf(stderr, "%s: can't read the rays and projection\n", base);
+    return 1;
+  }
+  struct FlexFovCube cube;
+  for (i=0; i<6; i++) {
+    snprintf(path, sizeof(path), "%s.face%d.ppm", base, i);
+    int fh2;
+    cube.faces[i] = read_ppm(path, &cube.sizes[i], &fh2);
+    if (!cube.faces[i]) cube.sizes[i] = 0;
+  }
+
+  struct FlexFovRays rays;
+  if (!flexfov_alloc_rays(&rays, w, h)) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  flexfov_build_rays(&knobs, &rays, threads);
+
+  double maxAngle = 0, sumAngle = 0;
+  long rayPixels = 0, blankMismatches = 0, colorPixels = 0, colorsWithin = 0;
+  int row, col;
+  for (row=0; row<h; row++) {
+    for (col=0; col<w; col++) {
+      const float *g = shaderRays + ((size_t)(h-1-row) * w + col) * 3; // (PFM rows go up)
+      size_t j = (size_t)row * w + col;
+      float r[3] = { rays.x[j], rays.y[j], rays.z[j] };
+      int shaderBlank = g[0] == 0.0f && g[1] == 0.0f && g[2] == 0.0f;
+      int ourBlank = r[0] == 0.0f && r[1] == 0.0f && r[2] == 0.0f;
+      if (shaderBlank != ourBlank) blankMismatches++;
+      if (shaderBlank) continue;
+
+      if (!ourBlank) {
+        double dot = (double)g[0]*r[0] + (double)g[1]*r[1] + (double)g[2]*r[2];
+        double cx = (double)g[1]*r[2] - (double)g[2]*r[1];
+        double cy = (double)g[2]*r[0] - (double)g[0]*r[2];
+        double cz = (double)g[0]*r[1] - (double)g[1]*r[0];
+        double angle = atan2(sqrt(cx*cx + cy*cy + cz*cz), dot);
+        if (angle > maxAngle) maxAngle = angle;
+        sumAngle += angle;
+        rayPixels++;
+      }
+
+      // (looked up along the shader's ray, so a ray error isn't counted twice)
+      float s, t;
+      int side = flexfov_ray_to_cubeside(g, &s, &t);
+      if (!cube.sizes[side]) continue;
+      colorPixels++;
+      colorsWithin += within_texels(&cube, side, s, t, frame[j]);
+    }
+  }
+
+  double blankShare = (double)blankMismatches / ((double)w * h);
+  double colorShare = colorPixels ? (double)colorsWithin / colorPixels : 1.0;
+  int pass = maxAngle <= GOLDEN_MAX_ANGLE && blankShare <= GOLDEN_MAX_BLANK && colorShare >= GOLDEN_MIN_COLORS;
+  printf("golden: %dx%d fov=%g pitch=%g mobius=%g cube=%d\n", w, h, knobs.fov, knobs.camPitch, knobs.mobiusZoom, knobs.useCube);
+  printf("golden: rays max=%.2e mean=%.2e rad, blank on one side %.3f%%\n",
+    maxAngle, rayPixels ? sumAngle / rayPixels : 0.0, blankShare * 100.0);
+  printf("golden: colors %.3f%% within the texels around ours\n", colorShare * 100.0);
+  printf("golden: %s\n", pass ? "pass" : "FAIL");
+
+  for (i=0; i<6; i++) free((void *)cube.faces[i]);
+  flexfov_free_rays(&rays);
+  free(shaderRays);
+  free(frame);
+  return !pass;
+}
+
+static double mpixels_per_sec(int w, int h, int frames, double seconds) {
+  return (double)w * h * frames / seconds / 1e6;
+}
+
+// vertices laid out like the game's Vtx (position, flag, texture coords, color)
+#define VTX_SHORTS 8
+#define FOG_LOAD 16        // vertices per load (a typical gSPVertex)
+#define FOG_VERTICES 65536
+
+typedef void (*FogFn)(float m[4][4], const short *ob, int stride, int n,
+                      const struct FlexFovFogPlanes *planes, float *z, float *w);
+
+static double bench_fog(FogFn fn, const short *vtx, int frames, float *z, float *w) {
+  // modelview of an object a little in front of a turned camera
+  float m[4][4] = {
+    { 0.8f, 0.0f, -0.6f, 0.0f },
+    { 0.0f, 1.0f,  0.0f, 0.0f },
+    { 0.6f, 0.0f,  0.8f, 0.0f },
+    { 100.0f, -200.0f, -3000.0f, 1.0f },
+  };
+  struct FlexFovFogPlanes planes;
+  flexfov_fog_planes(100.0f, 20000.0f, &planes);
+
+  int f, i;
+  double t0 = now();
+  for (f=0; f<frames; f++) {
+    for (i=0; i<FOG_VERTICES; i+=FOG_LOAD) {
+      fn(m, vtx + i*VTX_SHORTS, VTX_SHORTS, FOG_LOAD, &planes, z + i, w + i);
+    }
+  }
+  return (double)FOG_VERTICES * frames / (now() - t0) / 1e6;
+}
+
+static void bench_fogs(int frames) {
+  short *vtx = malloc(FOG_VERTICES * VTX_SHORTS * sizeof(*vtx));
+  float *z0 = malloc(FOG_VERTICES * sizeof(float)), *w0 = malloc(FOG_VERTICES * sizeof(float));
+  float *z1 = malloc(FOG_VERTICES * sizeof(float)), *w1 = malloc(FOG_VERTICES * sizeof(float));
+  if (!vtx || !z0 || !w0 || !z1 || !w1) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  int i;
+  srand(1);
+  for (i=0; i<FOG_VERTICES * VTX_SHORTS; i++) {
+    vtx[i] = (short)(rand() % 4096 - 2048);
+  }
+
+  // (more frames, since a frame of vertices is much quicker than a frame of pixels)
+  double scalar = bench_fog(flexfov_fog_depths_scalar, vtx, frames * 100, z0, w0);
+  double batched = bench_fog(flexfov_fog_depths, vtx, frames * 100, z1, w1);
+
+  float maxDiff = 0;
+  for (i=0; i<FOG_VERTICES; i++) {
+    float d = fabsf(z1[i] - z0[i]) / w0[i];
+    if (d > maxDiff) maxDiff = d;
+  }
+
+  printf("\nfog depths, %d vertices in loads of %d (Mvertices/s)\n", FOG_VERTICES, FOG_LOAD);
+  printf("%-24s %10s %10s %12s\n", "", "scalar", "batched", "max z/w diff");
+  printf("%-24s %10.1f %10.1f %12.2g\n", "fog", scalar, batched, maxDiff);
+
+  free(vtx);
+  free(z0); free(w0);
+  free(z1); free(w1);
+}
+
+int main(int argc, char **argv) {
+  int w = 1920, h = 1080, frames = 10;
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  const char *ppmPath = NULL;
+  const char *goldenPath = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:h:t:n:o:g:")) != -1) {
+    switch (opt) {
+      case 'w': w = atoi(optarg); break;
+      case 'h': h = atoi(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      case 'n': frames = atoi(optarg); break;
+      case 'o': ppmPath = optarg; break;
+      case 'g': goldenPath = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-w width] [-h height] [-t threads] [-n frames] [-o frame.ppm] | -g path\n", argv[0]);
+        return 1;
+    }
+  }
+  if (w < 1 || h < 1 || frames < 1) return 1;
+  if (threads < 1) threads = 1;
+  if (goldenPath) return compare_golden(goldenPath, threads);
+
+  struct FlexFovRays rays;
+  unsigned int *out = malloc((size_t)w * h * sizeof(*out));
+  if (!out || !flexfov_alloc_rays(&rays, w, h)) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  struct FlexFovCube cube;
+  int i;
+  for (i=0; i<6; i++) {
+    cube.faces[i] = make_face(i);
+    cube.sizes[i] = FACE_SIZE;
+  }
+
+  printf("%dx%d, %d frames, %d threads (Mpixels/s)\n", w, h, frames, threads);
+  printf("%-24s %10s %10s %10s %10s\n", "projection", "rays x1", "rays xN", "remap x1", "remap xN");
+
+  size_t c;
+  for (c=0; c<NUM_CONFIGS; c++) {
+    const struct FlexFovKnobs *knobs = &configs[c].knobs;
+    double rates[4];
+    int pass;
+    for (pass=0; pass<4; pass++) {
+      int n = pass % 2 == 0 ? 1 : threads;
+      int f;
+      double t0 = now();
+      for (f=0; f<frames; f++) {
+        if (pass < 2) flexfov_build_rays(knobs, &rays, n);
+        else flexfov_remap(&cube, &rays, out, n);
+      }
+      rates[pass] = mpixels_per_sec(w, h, frames, now() - t0);
+    }
+    printf("%-24s %10.1f %10.1f %10.1f %10.1f\n", configs[c].name, rates[0], rates[1], rates[2], rates[3]);
+  }
+
+  if (ppmPath) write_ppm(ppmPath, out, w, h);
+
+  bench_fogs(frames);
+
+  for (i=0; i<6; i++) free((void *)cube.faces[i]);
+  flexfov_free_rays(&rays);
+  free(out);
+  return 0;
+}
@@ -0,0 +1,69 @@
+#include "flexfov_fog.h"
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Get the non-linear normalization of a distance (z/w)
+// by passing the point (0,0,-dist) through the projection matrix.
+//
+//   float u[3] = {0.0f, 0.0f, dist};
+//   z = u[0] * p[0][2] + u[1] * p[1][2] + u[2] * p[2][2] + p[3][2];
+//   w = u[0] * p[0][3] + u[1] * p[1][3] + u[2] * p[2][3] + p[3][3];
+//
+//   This simplifies to the following:
+//   z = (-dist*(near+far) + 2*near*far) / (near-far);
+//   w = dist;
+void flexfov_fog_planes(float near, float far, struct FlexFovFogPlanes *planes) {
+  planes->scale = -(near+far) / (near-far);
+  planes->offset = 2*near*far / (near-far);
+}
+
+void flexfov_fog_depths_scalar(float m[4][4], const short *ob, int stride, int n,
+                               const struct FlexFovFogPlanes *planes, float *z, float *w) {
+  int i;
+  for (i=0; i<n; i++, ob += stride) {
+    float dx = ob[0] * m[0][0] + ob[1] * m[1][0] + ob[2] * m[2][0] + m[3][0];
+    float dy = ob[0] * m[0][1] + ob[1] * m[1][1] + ob[2] * m[2][1] + m[3][1];
+    float dz = ob[0] * m[0][2] + ob[1] * m[1][2] + ob[2] * m[2][2] + m[3][2];
+    float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+    z[i] = dist * planes->scale + planes->offset;
+    w[i] = dist;
+  }
+}
+
+#ifdef __SSE2__
+
+// four vertices at once (one per lane)
+static void fog_depths4(float m[4][4], const short *ob, int stride,
+                        const struct FlexFovFogPlanes *planes, float *z, float *w) {
+  __m128 x = _mm_setr_ps(ob[0], ob[stride], ob[2*stride], ob[3*stride]);
+  __m128 y = _mm_setr_ps(ob[1], ob[stride+1], ob[2*stride+1], ob[3*stride+1]);
+  __m128 v = _mm_setr_ps(ob[2], ob[stride+2], ob[2*stride+2], ob[3*stride+2]);
+
+#define ROW(j) _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m[0][j])), _mm_mul_ps(y, _mm_set1_ps(m[1][j]))), \
+                          _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(m[2][j])), _mm_set1_ps(m[3][j])))
+  __m128 dx = ROW(0);
+  __m128 dy = ROW(1);
+  __m128 dz = ROW(2);
+#undef ROW
+
+  __m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+  _mm_storeu_ps(z, _mm_add_ps(_mm_mul_ps(dist, _mm_set1_ps(planes->scale)), _mm_set1_ps(planes->offset)));
+  _mm_storeu_ps(w, dist);
+}
+
+#endif
+
+void flexfov_fog_depths(float m[4][4], const short *ob, int stride, int n,
+                        const struct FlexFovFogPlanes *planes, float *z, float *w) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i+4 <= n; i += 4) {
+    fog_depths4(m, ob + i*stride, stride, planes, z + i, w + i);
+  }
+#endif
+  flexfov_fog_depths_scalar(m, ob + i*stride, stride, n - i, planes, z + i, w + i);
+}
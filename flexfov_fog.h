@@ -0,0 +1,24 @@
+#ifndef _FLEXFOV_FOG_H
+#define _FLEXFOV_FOG_H
+
+// Fog depths of a load of vertices, scaled by their distance to the camera
+// so that fog is the same on every cubeface (see flexfov_set_fog_scale).
+// (plain C with no game headers, like flexfov_proj.h)
+
+// the fog depth (z/w) of a distance is z = dist*scale + offset, w = dist
+struct FlexFovFogPlanes {
+  float scale, offset;
+};
+
+void flexfov_fog_planes(float near, float far, struct FlexFovFogPlanes *planes);
+
+// Compute the clip z and w of `n` vertices for fog, from their object positions
+// (`stride` shorts apart) and the modelview `m`.
+void flexfov_fog_depths(float m[4][4], const short *ob, int stride, int n,
+                        const struct FlexFovFogPlanes *planes, float *z, float *w);
+
+// same as flexfov_fog_depths, one vertex at a time (the reference for the batched version)
+void flexfov_fog_depths_scalar(float m[4][4], const short *ob, int stride, int n,
+                               const struct FlexFovFogPlanes *planes, float *z, float *w);
+
+#endif // _FLEXFOV_FOG_H
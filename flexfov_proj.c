@@ -0,0 +1,263 @@
+#include "flexfov_proj.h"
+
+#include <math.h>
+
+// Each function mirrors the function of the same name in flexfov.frag.
+// Keep them in sync when changing the shader.
+
+typedef struct { float x, y; } vec2;
+typedef struct { float x, y, z; } vec3;
+
+static const float pi = 3.14159f;
+
+// The uniforms are passed to the functions that use them as `k`
+// (so that rays can be computed on several threads at once).
+
+static vec2 v2(float x, float y) { vec2 r = {x, y}; return r; }
+static vec3 v3(float x, float y, float z) { vec3 r = {x, y, z}; return r; }
+static vec2 scale2(vec2 a, float s) { return v2(a.x*s, a.y*s); }
+static float mix(float a, float b, float t) { return a + (b-a)*t; }
+static vec2 mix2(vec2 a, vec2 b, float t) { return v2(mix(a.x,b.x,t), mix(a.y,b.y,t)); }
+static vec3 mix3(vec3 a, vec3 b, float t) { return v3(mix(a.x,b.x,t), mix(a.y,b.y,t), mix(a.z,b.z,t)); }
+static float radians(float deg) { return deg * pi / 180.0f; }
+
+//------------------------------------------------------------------------------
+// Rays
+//------------------------------------------------------------------------------
+
+static vec3 latlon_to_ray(vec2 latlon) {
+  float lat = latlon.x;
+  float lon = latlon.y;
+  float x = sinf(lon)*cosf(lat);
+  float y = sinf(lat);
+  float z = cosf(lon)*cosf(lat);
+  return v3(x,y,z);
+}
+
+static vec2 ray_to_latlon(vec3 ray) {
+  float lat = asinf(ray.y);
+  float lon = atan2f(ray.x, ray.z);
+  return v2(lat,lon);
+}
+
+static vec3 scaleray(const struct FlexFovKnobs *k) {
+  return latlon_to_ray(v2(0.0f, radians(k->fov)/2.0f));
+}
+
+// inverse projections return this when uv is out of bounds
+static const vec3 blankRay = {-1.0f, -1.0f, -1.0f};
+
+static int is_blank(vec3 ray) {
+  return ray.x == blankRay.x && ray.y == blankRay.y && ray.z == blankRay.z;
+}
+
+//------------------------------------------------------------------------------
+// Stereographic projection
+//------------------------------------------------------------------------------
+
+static vec3 stereographic_inverse(vec2 uv) {
+  float x = uv.x;
+  float y = uv.y;
+  float r = sqrtf(x*x+y*y);
+  float theta = atanf(r)/0.5f;
+  float s = sinf(theta);
+  return v3(x/r*s, y/r*s, cosf(theta));
+}
+
+static vec2 stereographic_forward(vec3 ray) {
+  float theta = acosf(ray.z);
+  float r = tanf(theta*0.5f);
+  float c = r/sqrtf(ray.x*ray.x+ray.y*ray.y);
+  return v2(ray.x*c, ray.y*c);
+}
+
+//------------------------------------------------------------------------------
+// Panini projection
+//------------------------------------------------------------------------------
+
+static vec3 panini_inverse(vec2 uv) {
+  float x = uv.x;
+  float y = uv.y;
+  float d = 1.0f;
+  float kk = x*x/((d+1.0f)*(d+1.0f));
+  float dscr = kk*kk*d*d - (kk+1.0f)*(kk*d*d-1.0f);
+  float clon = (-kk*d+sqrtf(dscr))/(kk+1.0f);
+  float S = (d+1.0f)/(d+clon);
+  float lon = atan2f(x,S*clon);
+  float lat = atan2f(y,S);
+  return latlon_to_ray(v2(lat,lon));
+}
+
+static vec2 panini_forward(vec3 ray) {
+  vec2 latlon = ray_to_latlon(ray);
+  float lat = latlon.x;
+  float lon = latlon.y;
+  float d = 1.0f;
+  float S = (d+1.0f)/(d+cosf(lon));
+  return v2(S*sinf(lon), S*tanf(lat));
+}
+
+//------------------------------------------------------------------------------
+// “Flex” projection between Panini and Stereographic (using camPitch)
+//------------------------------------------------------------------------------
+
+static vec3 flex_inverse(const struct FlexFovKnobs *k, vec2 uv) {
+  float t = fabsf(k->camPitch)/(pi/2.0f);
+  return mix3(panini_inverse(uv),stereographic_inverse(uv),t);
+}
+
+static vec2 flex_forward(const struct FlexFovKnobs *k, vec3 ray) {
+  float t = fabsf(k->camPitch)/(pi/2.0f);
+  return mix2(panini_forward(ray),stereographic_forward(ray),t);
+}
+
+//------------------------------------------------------------------------------
+// Mobius scale (used for zooming Mercator and Equirect)
+//------------------------------------------------------------------------------
+
+static float getMobiusScale(const struct FlexFovKnobs *k) {
+  float m = k->mobiusZoom;
+  return m >= 0.0f ? mix(1.0f, 0.5f, m) : mix(1.0f, 2.0f, -m);
+}
+
+//------------------------------------------------------------------------------
+// Mercator projection
+//------------------------------------------------------------------------------
+
+static vec3 mercator_inverse(vec2 uv) {
+  if (fabsf(uv.x) > pi) return blankRay;
+  float lon = uv.x;
+  float lat = atanf(sinhf(uv.y));
+  return latlon_to_ray(v2(lat,lon));
+}
+
+static vec2 mercator_forward(vec3 ray) {
+  vec2 latlon = ray_to_latlon(ray);
+  float lat = latlon.x;
+  float lon = latlon.y;
+  return v2(lon, logf(tanf(pi*0.25f+lat*0.5f)));
+}
+
+static vec3 mercator(const struct FlexFovKnobs *k, vec2 uv) {
+  float m = getMobiusScale(k);
+
+  vec3 scaleRay = scaleray(k);
+  if (k->mobiusZoom != 0.0f) {
+    scaleRay = stereographic_inverse(scale2(stereographic_forward(scaleRay), 1.0f/m));
+  }
+  float scale = mercator_forward(scaleRay).x;
+  vec3 ray = mercator_inverse(scale2(uv, scale));
+  if (!is_blank(ray) && k->mobiusZoom != 0.0f) {
+    ray = flex_inverse(k, scale2(flex_forward(k, ray), m));
+  }
+  return ray;
+}
+
+//------------------------------------------------------------------------------
+// Equirectangular projection
+//------------------------------------------------------------------------------
+
+static vec3 equirect_inverse(vec2 uv) {
+  if (fabsf(uv.x) > pi || fabsf(uv.y) > pi/2.0f) return blankRay;
+  float lon = uv.x;
+  float lat = uv.y;
+  return latlon_to_ray(v2(lat,lon));
+}
+
+static vec2 equirect_forward(vec3 ray) {
+  vec2 latlon = ray_to_latlon(ray);
+  float lon = latlon.y;
+  return v2(lon, lon);
+}
+
+static vec3 equirect(const struct FlexFovKnobs *k, vec2 uv) {
+  float m = getMobiusScale(k);
+  float scale = equirect_forward(scaleray(k)).x;
+  vec3 ray = equirect_inverse(scale2(uv, scale));
+  if (!is_blank(ray) && k->mobiusZoom != 0.0f) {
+    ray = flex_inverse(k, scale2(flex_forward(k, ray), m));
+  }
+  return ray;
+}
+
+//------------------------------------------------------------------------------
+// Cube net projection
+//------------------------------------------------------------------------------
+
+static vec3 cubenet(vec2 uv) {
+  float i = uv.x*2.0f+2.0f;
+  float j = uv.y*2.0f+1.5f;
+
+  int col = (int)floorf(i);
+  int row = (int)floorf(j);
+  float u = mix(-1.0f, 1.0f, i - floorf(i));
+  float v = mix(-1.0f, 1.0f, j - floorf(j));
+
+  if (col == 1 && row == 1)      return v3(u, v, 1.0f);    // front
+  else if (col == 0 && row == 1) return v3(-1.0f, v, u);   // left
+  else if (col == 2 && row == 1) return v3(1.0f, v, -u);   // right
+  else if (col == 3 && row == 1) return v3(-u, v, -1.0f);  // back
+  else if (col == 1 && row == 2) return v3(u, 1.0f, -v);   // up
+  else if (col == 1 && row == 0) return v3(u, -1.0f, v);   // down
+  return blankRay;
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+void flexfov_aspect_uv(unsigned int width, unsigned int height, float *u, float *v) {
+  float aspect=(float)width/(float)height;
+  float defaultAspect=4.0f/3.0f;
+  if (aspect < defaultAspect) {
+    // narrow
+    *v = 1.0f/defaultAspect;
+    *u = *v*aspect;
+  } else {
+    // wide
+    *u = aspect/defaultAspect;
+    *v = 1.0f/defaultAspect;
+  }
+}
+
+int flexfov_uv_to_ray(const struct FlexFovKnobs *k, float u, float v, float ray[3]) {
+  vec2 uv = v2(u, v);
+  vec3 r = blankRay;
+  if (k->useCube)          { r = cubenet(uv); }
+  else if (k->fov < 360.0f) { r = mercator(k, uv); }
+  else if (k->fov == 360.0f) { r = equirect(k, uv); }
+  if (is_blank(r)) return 0;
+
+  // stereographic divides 0 by 0 at the very center (the shader gets a NaN there too)
+  if (r.x != r.x || r.y != r.y || r.z != r.z) return 0;
+
+  ray[0] = r.x;
+  ray[1] = r.y;
+  ray[2] = r.z;
+  return 1;
+}
+
+int flexfov_ray_to_cubeside(const float ray[3], float *s, float *t) {
+  // flip the ray like `cuberay` (accounting for upside-down textures)
+  float x = ray[0], y = ray[1], z = ray[2];
+  float ax = fabsf(x), ay = fabsf(y), az = fabsf(z);
+  int upOrDownFace = ay >= ax && ay >= az;
+  if (upOrDownFace) z = -z; else y = -y;
+
+  // then select the face like `cubeside`
+  int side;
+  float sc, tc, ma;
+  if (upOrDownFace) {
+    side = y > 0.0f ? FLEXFOV_CUBE_UP : FLEXFOV_CUBE_DOWN;
+    sc = x; tc = y > 0.0f ? z : -z; ma = ay;
+  } else if (ax >= az) {
+    side = x > 0.0f ? FLEXFOV_CUBE_RIGHT : FLEXFOV_CUBE_LEFT;
+    sc = x > 0.0f ? -z : z; tc = -y; ma = ax;
+  } else {
+    side = z > 0.0f ? FLEXFOV_CUBE_FRONT : FLEXFOV_CUBE_BACK;
+    sc = z > 0.0f ? x : -x; tc = -y; ma = az;
+  }
+  *s = (sc/ma * FLEXFOV_FACE_SCALE + 1.0f) * 0.5f;
+  *t = (tc/ma * FLEXFOV_FACE_SCALE + 1.0f) * 0.5f;
+  return side;
+}
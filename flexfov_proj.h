@@ -0,0 +1,40 @@
+#ifndef _FLEXFOV_PROJ_H
+#define _FLEXFOV_PROJ_H
+
+// CPU mirror of the projections in flexfov.frag.
+// (plain C with no game headers, so it can be used outside the game)
+
+enum FLEXFOV_CUBE_SIDE {
+  FLEXFOV_CUBE_FRONT,
+  FLEXFOV_CUBE_LEFT,
+  FLEXFOV_CUBE_RIGHT,
+  FLEXFOV_CUBE_BACK,
+  FLEXFOV_CUBE_UP,
+  FLEXFOV_CUBE_DOWN
+};
+
+// same knobs as the shader uniforms
+struct FlexFovKnobs {
+  float fov;
+  float camPitch;
+  float mobiusZoom;
+  int useCube;
+};
+
+// Get the aspect-normalized uv at the right and top edges of the screen (see flexfov.frag).
+void flexfov_aspect_uv(unsigned int width, unsigned int height, float *u, float *v);
+
+// Get the ray for an aspect-normalized uv (see flexfov.frag).
+// Returns 0 if the uv is outside the projection (i.e. a blank ray).
+int flexfov_uv_to_ray(const struct FlexFovKnobs *knobs, float u, float v, float ray[3]);
+
+// Each cubeface is rendered a little wider than 90°, so that filtering near its edges
+// reads the gutter rendered past them instead of clamped texels. The gutter is given
+// as a part of the 90° half-width, and the 90° square takes FLEXFOV_FACE_SCALE of the face.
+#define FLEXFOV_FACE_GUTTER (1.0f/16)
+#define FLEXFOV_FACE_SCALE (1.0f / (1.0f + FLEXFOV_FACE_GUTTER))
+
+// Get the cubeside and its texture coordinates (0 to 1) that the shader samples for a ray.
+int flexfov_ray_to_cubeside(const float ray[3], float *s, float *t);
+
+#endif // _FLEXFOV_PROJ_H
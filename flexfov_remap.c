@@ -0,0 +1,253 @@
+#include "flexfov_remap.h"
+
+#include <stdlib.h> // import malloc, free
+#include <string.h> // import memcpy
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// translucent black where the projection has no ray (see blankColor in flexfov.frag)
+static const unsigned char blankRGBA[4] = { 0, 0, 0, 128 };
+
+//------------------------------------------------------------------------------
+// Threads (each thread takes a band of rows)
+//------------------------------------------------------------------------------
+
+#define MAX_THREADS 64
+
+typedef void (*RowsFn)(const void *job, int row0, int row1);
+
+struct Band {
+  RowsFn fn;
+  const void *job;
+  int row0, row1;
+};
+
+static void *run_band(void *arg) {
+  struct Band *b = arg;
+  b->fn(b->job, b->row0, b->row1);
+  return NULL;
+}
+
+static void run_rows(RowsFn fn, const void *job, int height, int threads) {
+  if (threads < 1) threads = 1;
+  if (threads > MAX_THREADS) threads = MAX_THREADS;
+  if (threads > height) threads = height;
+
+  pthread_t ids[MAX_THREADS];
+  struct Band bands[MAX_THREADS];
+  int i;
+  for (i=0; i<threads; i++) {
+    bands[i].fn = fn;
+    bands[i].job = job;
+    bands[i].row0 = height * i / threads;
+    bands[i].row1 = height * (i+1) / threads;
+  }
+
+  // the calling thread takes the first band
+  // (falling back to it for any band whose thread can't be started)
+  int started[MAX_THREADS] = {0};
+  for (i=1; i<threads; i++) {
+    started[i] = pthread_create(&ids[i], NULL, run_band, &bands[i]) == 0;
+  }
+  run_band(&bands[0]);
+  for (i=1; i<threads; i++) {
+    if (started[i]) pthread_join(ids[i], NULL);
+    else run_band(&bands[i]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Rays (the ray pass)
+//------------------------------------------------------------------------------
+
+int flexfov_alloc_rays(struct FlexFovRays *rays, int width, int height) {
+  size_t n = (size_t)width * height;
+  rays->width = width;
+  rays->height = height;
+  rays->x = malloc(n * sizeof(float));
+  rays->y = malloc(n * sizeof(float));
+  rays->z = malloc(n * sizeof(float));
+  if (!rays->x || !rays->y || !rays->z) {
+    flexfov_free_rays(rays);
+    return 0;
+  }
+  return 1;
+}
+
+void flexfov_free_rays(struct FlexFovRays *rays) {
+  free(rays->x);
+  free(rays->y);
+  free(rays->z);
+  rays->x = rays->y = rays->z = NULL;
+}
+
+struct RaysJob {
+  const struct FlexFovKnobs *knobs;
+  struct FlexFovRays *rays;
+};
+
+// (the projection math stays scalar: each projection is a chain of atan, sinh, asin
+//  and atan2 that SSE and AVX have no instructions for, and vector approximations of
+//  them would no longer mirror the shader one-to-one, which the golden frame checks.
+//  It also only runs when the knobs change, like the ray pass, so the per-frame part,
+//  the cube lookup, is the one batched below.)
+static void build_rows(const void *arg, int row0, int row1) {
+  const struct RaysJob *job = arg;
+  struct FlexFovRays *rays = job->rays;
+  int w = rays->width, h = rays->height;
+
+  float uMax, vMax;
+  flexfov_aspect_uv(w, h, &uMax, &vMax);
+
+  int row, col;
+  for (row=row0; row<row1; row++) {
+    // uv at the pixel center (like vUV in the shader, but rows go down)
+    float v = vMax - 2.0f*vMax*(row+0.5f)/h;
+    size_t i = (size_t)row * w;
+    for (col=0; col<w; col++, i++) {
+      float u = -uMax + 2.0f*uMax*(col+0.5f)/w;
+      float ray[3];
+      if (!flexfov_uv_to_ray(job->knobs, u, v, ray)) {
+        ray[0] = ray[1] = ray[2] = 0.0f;
+      }
+      rays->x[i] = ray[0];
+      rays->y[i] = ray[1];
+      rays->z[i] = ray[2];
+    }
+  }
+}
+
+void flexfov_build_rays(const struct FlexFovKnobs *knobs, struct FlexFovRays *rays, int threads) {
+  struct RaysJob job = { knobs, rays };
+  run_rows(build_rows, &job, rays->height, threads);
+}
+
+//------------------------------------------------------------------------------
+// Cube lookup
+//------------------------------------------------------------------------------
+
+struct RemapJob {
+  const struct FlexFovCube *cube;
+  const struct FlexFovRays *rays;
+  unsigned int *out;
+};
+
+// nearest texel of a cubeface
+static unsigned int fetch(const struct FlexFovCube *cube, int side, float s, float t) {
+  int size = cube->sizes[side];
+  int x = (int)(s * size);
+  int y = (int)(t * size);
+  if (x < 0) x = 0; else if (x >= size) x = size-1;
+  if (y < 0) y = 0; else if (y >= size) y = size-1;
+  return cube->faces[side][y*size + x];
+}
+
+static unsigned int remap_pixel(const struct FlexFovCube *cube, float x, float y, float z) {
+  unsigned int color;
+  if (x == 0.0f && y == 0.0f && z == 0.0f) {
+    memcpy(&color, blankRGBA, sizeof(color));
+    return color;
+  }
+  float ray[3] = { x, y, z };
+  float s, t;
+  int side = flexfov_ray_to_cubeside(ray, &s, &t);
+  return fetch(cube, side, s, t);
+}
+
+#ifdef __SSE2__
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 not_ps(__m128 mask) {
+  return _mm_andnot_ps(mask, _mm_castsi128_ps(_mm_set1_epi32(-1)));
+}
+
+// negate where the mask is set
+static inline __m128 negate_ps(__m128 mask, __m128 a) {
+  return _mm_xor_ps(a, _mm_and_ps(mask, _mm_set1_ps(-0.0f)));
+}
+
+// Select the cubeside and texture coords of four rays at once
+// (same as flexfov_ray_to_cubeside, which does the flip of `cuberay` first).
+static void cubeside4(const float *px, const float *py, const float *pz, int side[4], float s[4], float t[4], int blank[4]) {
+  __m128 zero = _mm_setzero_ps();
+  __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 x = _mm_loadu_ps(px);
+  __m128 y = _mm_loadu_ps(py);
+  __m128 z = _mm_loadu_ps(pz);
+  __m128 ax = _mm_and_ps(x, absMask);
+  __m128 ay = _mm_and_ps(y, absMask);
+  __m128 az = _mm_and_ps(z, absMask);
+
+  __m128 upOrDown = _mm_and_ps(_mm_cmpge_ps(ay, ax), _mm_cmpge_ps(ay, az));
+  __m128 leftOrRight = _mm_andnot_ps(upOrDown, _mm_cmpge_ps(ax, az));
+
+  // flip (accounting for upside-down textures)
+  z = negate_ps(upOrDown, z);
+  y = negate_ps(not_ps(upOrDown), y);
+
+  __m128 xPos = _mm_cmpgt_ps(x, zero);
+  __m128 yPos = _mm_cmpgt_ps(y, zero);
+  __m128 zPos = _mm_cmpgt_ps(z, zero);
+
+  // up or down:     sc = x;              tc = y > 0 ? z : -z;  ma = |y|
+  // right or left:  sc = x > 0 ? -z : z; tc = -y;              ma = |x|
+  // front or back:  sc = z > 0 ? x : -x; tc = -y;              ma = |z|
+  __m128 sc = select_ps(upOrDown, x,
+              select_ps(leftOrRight, negate_ps(xPos, z), negate_ps(not_ps(zPos), x)));
+  __m128 tc = select_ps(upOrDown, negate_ps(not_ps(yPos), z), _mm_sub_ps(zero, y));
+  __m128 ma = select_ps(upOrDown, ay, select_ps(leftOrRight, ax, az));
+
+  __m128 sideF = select_ps(upOrDown, select_ps(yPos, _mm_set1_ps(FLEXFOV_CUBE_UP), _mm_set1_ps(FLEXFOV_CUBE_DOWN)),
+                 select_ps(leftOrRight, select_ps(xPos, _mm_set1_ps(FLEXFOV_CUBE_RIGHT), _mm_set1_ps(FLEXFOV_CUBE_LEFT)),
+                 select_ps(zPos, _mm_set1_ps(FLEXFOV_CUBE_FRONT), _mm_set1_ps(FLEXFOV_CUBE_BACK))));
+
+  // blank rays are zero (keep them from dividing by zero)
+  __m128 isBlank = _mm_cmpeq_ps(ma, zero);
+  ma = select_ps(isBlank, _mm_set1_ps(1.0f), ma);
+
+  __m128 half = _mm_set1_ps(0.5f);
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 scale = _mm_set1_ps(FLEXFOV_FACE_SCALE);
+  _mm_storeu_ps(s, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_div_ps(sc, ma), scale), one), half));
+  _mm_storeu_ps(t, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_div_ps(tc, ma), scale), one), half));
+  _mm_storeu_si128((__m128i *)side, _mm_cvttps_epi32(sideF));
+  _mm_storeu_si128((__m128i *)blank, _mm_castps_si128(isBlank));
+}
+
+#endif
+
+static void remap_rows(const void *arg, int row0, int row1) {
+  const struct RemapJob *job = arg;
+  const struct FlexFovRays *rays = job->rays;
+  size_t i = (size_t)row0 * rays->width;
+  size_t end = (size_t)row1 * rays->width;
+
+#ifdef __SSE2__
+  unsigned int blankColor;
+  memcpy(&blankColor, blankRGBA, sizeof(blankColor));
+  for (; i+4 <= end; i += 4) {
+    int side[4], blank[4];
+    float s[4], t[4];
+    cubeside4(rays->x + i, rays->y + i, rays->z + i, side, s, t, blank);
+    int j;
+    for (j=0; j<4; j++) {
+      job->out[i+j] = blank[j] ? blankColor : fetch(job->cube, side[j], s[j], t[j]);
+    }
+  }
+#endif
+
+  for (; i < end; i++) {
+    job->out[i] = remap_pixel(job->cube, rays->x[i], rays->y[i], rays->z[i]);
+  }
+}
+
+void flexfov_remap(const struct FlexFovCube *cube, const struct FlexFovRays *rays, unsigned int *out, int threads) {
+  struct RemapJob job = { cube, rays, out };
+  run_rows(remap_rows, &job, rays->height, threads);
+}
@@ -0,0 +1,35 @@
+#ifndef _FLEXFOV_REMAP_H
+#define _FLEXFOV_REMAP_H
+
+// CPU version of the whole projection pass: the ray pass and the cubemap lookup
+// of flexfov.frag, for remapping a cube image into a projected frame without a GPU.
+// (plain C with no game headers, like flexfov_proj.h)
+
+#include "flexfov_proj.h"
+
+// ray of each pixel of a frame (rows from top to bottom)
+// (stored as separate x, y and z arrays, with blank rays stored as zero like the ray texture)
+struct FlexFovRays {
+  int width, height;
+  float *x, *y, *z;
+};
+
+// six cubefaces of RGBA pixels, each face `sizes[i]` texels across
+// (rows in the order of their texture coord t, i.e. as read back by glReadPixels)
+struct FlexFovCube {
+  const unsigned int *faces[6];
+  int sizes[6];
+};
+
+// allocate or free the arrays of a ray table
+int flexfov_alloc_rays(struct FlexFovRays *rays, int width, int height);
+void flexfov_free_rays(struct FlexFovRays *rays);
+
+// Compute the ray of each pixel for the given knobs (split across `threads` threads).
+void flexfov_build_rays(const struct FlexFovKnobs *knobs, struct FlexFovRays *rays, int threads);
+
+// Look up the cube image along each ray, writing one RGBA pixel per ray
+// (nearest texel, or translucent black for blank rays).
+void flexfov_remap(const struct FlexFovCube *cube, const struct FlexFovRays *rays, unsigned int *out, int threads);
+
+#endif // _FLEXFOV_REMAP_H